@@ -0,0 +1,48 @@
+#ifndef ACCESS_HXX
+#define ACCESS_HXX
+#include <cstddef>
+#include <array>
+#include <string>
+#include <cstdio>
+#include <stdexcept>
+#include <type_traits>
+
+/* Indexing for the emulator's memories. Built with CHECKED_ACCESS every index is bounds checked, and a bad one throws
+ * std::out_of_range naming the component and the address. Otherwise fixed size memories that are a power of two in
+ * size have the index masked to that size, so the compiler can see it's in range and emits a plain load, and anything
+ * else is indexed as it is. */
+
+template<typename Memory>
+struct is_fixed_size_memory : std::false_type {};
+
+template<typename T, size_t N>
+struct is_fixed_size_memory<std::array<T, N>> : std::true_type {};
+
+#ifdef CHECKED_ACCESS
+[[noreturn]] inline void memory_access_out_of_range(const char *component, size_t index, size_t size) {
+    char message[128];
+    std::snprintf(message, sizeof(message), "%s accessed out of range at $%zx, size is $%zx", component, index, size);
+    throw std::out_of_range(message);
+}
+#endif
+
+template<typename Memory>
+inline auto &memory_at(Memory &memory, size_t index, [[maybe_unused]] const char *component) {
+    #ifdef CHECKED_ACCESS
+    if(index >= memory.size()) {
+        memory_access_out_of_range(component, index, memory.size());
+    }
+    return memory[index];
+    #else
+    using Storage = std::remove_const_t<Memory>;
+    if constexpr(is_fixed_size_memory<Storage>::value) {
+        constexpr size_t size = std::tuple_size<Storage>::value;
+        if constexpr((size & (size - 1)) == 0) {
+            return memory[index & (size - 1)];
+        }
+    }
+    return memory[index];
+    #endif
+}
+
+#endif //ACCESS_HXX
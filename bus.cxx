@@ -1,17 +1,29 @@
 #include <iostream>
 #include <cassert>
+#include <algorithm>
 #include "bus.hxx"
+#include "access.hxx"
 #include "rom.hxx"
+#include "mapper.hxx"
 #include "ppu.hxx"
 #include "controller.hxx"
+#include "scheduler.hxx"
 
 Bus::Bus() {
     this->ram.fill(0);
     this->vram.fill(0);
+    this->read_pages.fill(nullptr);
+    this->write_pages.fill(nullptr);
+    this->map_ram();
+    this->events = 0;
+    this->scheduler = nullptr;
 }
 
 void Bus::connect_rom(Rom *rom) {
     this->rom = rom;
+    this->map_prgrom();
+    this->map_prgram();
+    this->map_nametables();
 }
 
 void Bus::connect_ppu(Ppu *ppu) {
@@ -22,12 +34,24 @@ void Bus::connect_controller(Controller *controller) {
     this->controller = controller;
 }
 
+void Bus::connect_scheduler(Scheduler *scheduler) {
+    this->scheduler = scheduler;
+}
+
+/* Pages backed by memory are copied in one go. Anything else is copied a byte at a time through the OAM data port,
+ * since reading it can have side effects, including on OAM itself when the source is the PPU's own registers. */
 void Bus::process_oam_dma(uint8_t value) {
-    int page_start = value << 8;
-    int page_end = page_start + 0xff;
-    for(int x = page_start; x <= page_end; x++) {
-        this->ppu->receive_oam_dma(this->read_ram(x));
+    const uint8_t *page = this->read_pages[value];
+    if(page != nullptr) {
+        this->ppu->receive_oam_dma(page);
     }
+    else {
+        int page_start = value << 8;
+        for(int x = 0; x < PAGE_SIZE; x++) {
+            this->ppu->write_oam(this->read_ram(page_start + x));
+        }
+    }
+    this->raise_event(Event::oam_dma);
 }
 
 uint16_t Bus::truncate_ram_address(uint16_t address) {
@@ -40,10 +64,34 @@ uint16_t Bus::truncate_ram_address(uint16_t address) {
     return address;
 }
 
-uint8_t Bus::read_ram(uint16_t address) {
+//The 2KB of ram is mirrored four times over $0000-$1fff.
+void Bus::map_ram() {
+    for(int page = RAM_ADDRESS_START / PAGE_SIZE; page <= RAM_ADDRESS_END / PAGE_SIZE; page++) {
+        uint8_t *memory = &this->ram[(page * PAGE_SIZE) & RAM_ADDRESS_MAX_BITS];
+        this->read_pages[page] = memory;
+        this->write_pages[page] = memory;
+    }
+}
+
+//Points the PRG-ROM pages at whatever the cartridge has there right now. Writes to them stay with write_io.
+void Bus::map_prgrom() {
+    for(int page = ROM_START / PAGE_SIZE; page <= ROM_END / PAGE_SIZE; page++) {
+        this->read_pages[page] = this->rom->get_prgrom_page(page * PAGE_SIZE - ROM_START);
+    }
+}
+
+void Bus::map_prgram() {
+    uint8_t *prgram = this->rom->get_prgram();
+    for(int page = PRGRAM_START / PAGE_SIZE; page <= PRGRAM_END / PAGE_SIZE; page++) {
+        this->read_pages[page] = prgram + (page * PAGE_SIZE - PRGRAM_START);
+        this->write_pages[page] = this->read_pages[page];
+    }
+}
+
+uint8_t Bus::read_io(uint16_t address) {
     address = this->truncate_ram_address(address);
     if (address <= RAM_ADDRESS_MAX_BITS) {
-        return this->ram.at(address);
+        return memory_at(this->ram, address, "ram");
     }
     if (address >= PPU_ADDRESS_START & address <= PPU_ADDRESS_MAX_BITS) {
         switch (address) {
@@ -71,21 +119,30 @@ uint8_t Bus::read_ram(uint16_t address) {
 
 //The NES CPU uses little endian binary representation, aka the least significant byte first.
 uint16_t Bus::read_ram_16(uint16_t address) {
+    uint8_t *page = this->read_pages[address >> 8];
+    if(page != nullptr && (address & 0xff) != 0xff) {
+        return page[(address & 0xff) + 1] << 8 | page[address & 0xff];
+    }
     return this->read_ram(address + 1) << 8 | this->read_ram(address);
 }
 
-void Bus::write_ram(uint16_t address, uint8_t value) {
+void Bus::write_io(uint16_t address, uint8_t value) {
     address = this->truncate_ram_address(address);
     if (address <= RAM_ADDRESS_MAX_BITS) {
-        this->ram.at(address) = value;
+        memory_at(this->ram, address, "ram") = value;
     }
     if (address >= PPU_ADDRESS_START & address <= PPU_ADDRESS_MAX_BITS) {
         switch (address) {
+            //Both decide when the ppu clocks a mapper's scanline counter.
             case Ppu::PPU_CONTROLLER:
+                this->scheduler->sync_mapper_irq();
                 this->ppu->write_controller(value);
+                this->scheduler->schedule_mapper_irq();
                 break;
             case Ppu::PPU_MASK:
+                this->scheduler->sync_mapper_irq();
                 this->ppu->write_mask(value);
+                this->scheduler->schedule_mapper_irq();
                 break;
             case Ppu::PPU_OAM_ADDRESS:
                 this->ppu->write_oam_address(value);
@@ -114,6 +171,36 @@ void Bus::write_ram(uint16_t address, uint8_t value) {
                 break;
         }
     }
+    if(address >= ROM_START) {
+        this->write_mapper(address, value);
+    }
+}
+
+/* Bank switches only move the rom's window pointers, so the page table and nametables are just pointed at them again,
+ * and only when the write moved them. CHR is read through the windows and needs nothing here. A scanline counter is
+ * caught up before the write and its IRQ predicted again after it. */
+void Bus::write_mapper(uint16_t address, uint8_t value) {
+    this->scheduler->sync_mapper_irq();
+    uint8_t changes = this->rom->write_mapper(address, value);
+    if(changes & Mapper::prgrom_changed) {
+        this->map_prgrom();
+        this->raise_event(Event::prgrom_switched);
+    }
+    if(changes & Mapper::mirroring_changed) {
+        this->map_nametables();
+    }
+    this->scheduler->schedule_mapper_irq();
+}
+
+//Fills count bytes of cpu ram starting at address, following the ram mirrors.
+void Bus::fill_ram(uint16_t address, uint8_t value, int count) {
+    while(count > 0) {
+        int offset = address & RAM_ADDRESS_MAX_BITS;
+        int chunk = std::min(count, RAMSIZE - offset);
+        std::fill_n(this->ram.begin() + offset, chunk, value);
+        address += chunk;
+        count -= chunk;
+    }
 }
 
 void Bus::write_ram_16(uint16_t address, uint16_t value) {
@@ -157,9 +244,25 @@ uint16_t Bus::nametable_mirroring_calculator(uint16_t vram_address) {
                 return vram_address - 0x800;
         }
     }
+    if (rom->get_mirroring_type() == Rom::MirroringType::single_screen_lower) {
+        return vram_address % NAMETABLE_SIZE;
+    }
+    if (rom->get_mirroring_type() == Rom::MirroringType::single_screen_upper) {
+        return NAMETABLE_SIZE + vram_address % NAMETABLE_SIZE;
+    }
+    if (rom->get_mirroring_type() == Rom::MirroringType::four_screen) {
+        return vram_address;
+    }
     assert("Mirroring Type not supported" && 1 == 0);
 }
 
+//Has to be called again whenever the mirroring type changes.
+void Bus::map_nametables() {
+    for (int x = 0; x < 4; x++) {
+        this->nametables[x] = &this->vram[this->nametable_mirroring_calculator(x * NAMETABLE_SIZE)];
+    }
+}
+
 uint8_t Bus::read_vram(uint16_t address) {
     address = this->truncate_vram_address(address);
     if (address <= PATTERN_TABLE_END) {
@@ -167,8 +270,7 @@ uint8_t Bus::read_vram(uint16_t address) {
     }
     if (address >= NAMETABLE_START & address <= NAMETABLE_MAX_BITS) {
         address -= NAMETABLE_START;
-        address = this->nametable_mirroring_calculator(address);
-        return this->vram.at(address);
+        return this->nametables[address / NAMETABLE_SIZE][address % NAMETABLE_SIZE];
     }
     if (address >= PALETTE_RAM_START) {
         return this->ppu->read_pallete_ram(address - PALETTE_RAM_START);
@@ -178,10 +280,12 @@ uint8_t Bus::read_vram(uint16_t address) {
 
 void Bus::write_vram(uint16_t address, uint8_t value) {
     address = this->truncate_vram_address(address);
+    if (address <= PATTERN_TABLE_END) {
+        this->rom->write_chrrom(address, value);
+    }
     if (address >= NAMETABLE_START & address <= NAMETABLE_MAX_BITS) {
         address -= NAMETABLE_START;
-        address = this->nametable_mirroring_calculator(address);
-        this->vram.at(address) = value;
+        this->nametables[address / NAMETABLE_SIZE][address % NAMETABLE_SIZE] = value;
     }
     if (address >= PALETTE_RAM_START) {
         this->ppu->write_pallete_ram(address - PALETTE_RAM_START, value);
@@ -225,19 +329,32 @@ void Bus::vram_debug_view(int start, int stop) {
     void bus_test_nametable_mirroring() {
         Bus bus;
         DummyRom rom;
-        rom.mirroring_type = MirroringType::horizontal;
+        rom.mirroring_type = Rom::MirroringType::horizontal;
         bus.connect_rom(&rom);
         assert(bus.nametable_mirroring_calculator(0x1) == 0x1);
         assert(bus.nametable_mirroring_calculator(0x401) == 0x1);
-        assert(bus.nametable_mirroring_calculator(0x801) == 0x801);
-        assert(bus.nametable_mirroring_calculator(0xc01) == 0x801);
+        assert(bus.nametable_mirroring_calculator(0x801) == 0x401);
+        assert(bus.nametable_mirroring_calculator(0xc01) == 0x401);
         std::cout << "Horizontal nametable mirroring test passed" << std::endl;
-        rom.mirroring_type = MirroringType::vertical;
+        rom.mirroring_type = Rom::MirroringType::vertical;
         assert(bus.nametable_mirroring_calculator(0x1) == 0x1);
         assert(bus.nametable_mirroring_calculator(0x401) == 0x401);
         assert(bus.nametable_mirroring_calculator(0x801) == 0x1);
         assert(bus.nametable_mirroring_calculator(0xc01) == 0x401);
         std::cout << "Vertial nametable mirroring test passed" << std::endl;
+        rom.mirroring_type = Rom::MirroringType::single_screen_upper;
+        assert(bus.nametable_mirroring_calculator(0x1) == 0x401);
+        assert(bus.nametable_mirroring_calculator(0xc01) == 0x401);
+        rom.mirroring_type = Rom::MirroringType::four_screen;
+        assert(bus.nametable_mirroring_calculator(0x801) == 0x801);
+        assert(bus.nametable_mirroring_calculator(0xc01) == 0xc01);
+        std::cout << "Single and four screen nametable mirroring test passed" << std::endl;
+        rom.mirroring_type = Rom::MirroringType::vertical;
+        bus.map_nametables();
+        bus.write_vram(0x2c01, 0xab);
+        assert(bus.read_vram(0x2401) == 0xab);
+        assert(bus.read_vram(0x3c01) == 0xab);
+        std::cout << "Nametable mapping test passed" << std::endl;
     }
 
     void run_bus_tests() {
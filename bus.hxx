@@ -4,11 +4,13 @@
 #include <cstdint>
 #include <array>
 #include "config.hxx"
+#include "interrupt.hxx"
 
 //Forward declaration
 class Rom;
 class Ppu;
 class Controller;
+class Scheduler;
 
 class Bus {
 public:
@@ -22,6 +24,8 @@ public:
     static const int IO_ADDRESS_END          = 0x4017;
     static const int IO_DISABLED_START       = 0x4018;
     static const int IO_DISABED_END          = 0x401f;
+    static const int PRGRAM_START            = 0x6000;
+    static const int PRGRAM_END              = 0x7fff;
     static const int ROM_START               = 0x8000;
     static const int ROM_END                 = 0xffff;
     static const int PATTERN_TABLE_START  = 0x0000;
@@ -34,23 +38,63 @@ public:
     static const int PALETTE_RAM_MAX_BITS = 0x3f1f;
     static const int PATTERN_TABLE_SIZE = 0x1000;
     static const int NAMETABLE_SIZE     = 0x0400;
+    static const int PAGE_SIZE  = 0x100;
+    static const int PAGE_COUNT = 0x100;
+    /* The cpu checks these after every instruction, so they come first and share a cache line. The page tables and
+     * ram follow, the cartridge side and vram come last. */
+    alignas(64) InterruptLines interrupts;
+    //Things the cpu has to catch up on after an instruction, it clears each one once it has.
+    enum class Event : uint8_t {
+        oam_dma         = 0b1,
+        prgrom_switched = 0b10
+    };
+    uint8_t events;
+    bool has_event(Event event) {return this->events & static_cast<uint8_t>(event);};
+    void raise_event(Event event) {this->events |= static_cast<uint8_t>(event);};
+    void clear_event(Event event) {this->events &= ~static_cast<uint8_t>(event);};
 private:
     static const int RAMSIZE  = 2048;
-    static const int VRAMSIZE = 2048;
+    static const int VRAMSIZE = 4096;
     uint16_t truncate_ram_address(uint16_t);
     uint16_t truncate_vram_address(uint16_t);
     uint16_t nametable_mirroring_calculator(uint16_t);
     void process_oam_dma(uint8_t);
-    std::array<uint8_t, RAMSIZE>  ram;
+    uint8_t read_io(uint16_t);
+    void write_io(uint16_t, uint8_t);
+    void write_mapper(uint16_t, uint8_t);
+    void map_ram();
+    /* One entry per 256 byte page of the cpu address space. Pages backed by plain memory point straight at it, pages
+     * left as nullptr have side effects or nothing behind them and go through read_io/write_io instead. */
+    alignas(64) std::array<uint8_t*, PAGE_COUNT> read_pages;
+    std::array<uint8_t*, PAGE_COUNT> write_pages;
+    alignas(64) std::array<uint8_t, RAMSIZE>  ram;
+    //Where each of the four nametables at $2000, $2400, $2800 and $2c00 lives in vram.
+    std::array<uint8_t*, 4> nametables;
     std::array<uint8_t, VRAMSIZE> vram;
 public:
     Bus();
     void connect_rom(Rom *);
     void connect_ppu(Ppu *);
     void connect_controller(Controller *);
-    uint8_t read_ram(uint16_t);
+    void connect_scheduler(Scheduler *);
+    void map_prgrom();
+    void map_prgram();
+    void map_nametables();
+    uint8_t read_ram(uint16_t address) {
+        uint8_t *page = this->read_pages[address >> 8];
+        return page != nullptr ? page[address & 0xff] : this->read_io(address);
+    };
     uint16_t read_ram_16(uint16_t);
-    void write_ram(uint16_t, uint8_t);
+    void write_ram(uint16_t address, uint8_t value) {
+        uint8_t *page = this->write_pages[address >> 8];
+        if(page != nullptr) {
+            page[address & 0xff] = value;
+        }
+        else {
+            this->write_io(address, value);
+        }
+    };
+    void fill_ram(uint16_t, uint8_t, int);
     void write_ram_16(uint16_t, uint16_t);
     uint8_t read_vram(uint16_t);
     void write_vram(uint16_t, uint8_t);
@@ -58,6 +102,7 @@ public:
     Rom *rom;
     Ppu *ppu;
     Controller *controller;
+    Scheduler *scheduler;
 };
 
 #ifdef UNITTEST
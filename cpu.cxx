@@ -1,8 +1,11 @@
 #include <cassert>
+#include <algorithm>
 #include "config.hxx"
 #include "cpu.hxx"
 #include "bus.hxx"
 #include "ppu.hxx"
+#include "rom.hxx"
+#include "mapper.hxx"
 #ifdef CPU_DEBUG_OUTPUT
 #include <iostream>
 #include <array>
@@ -14,23 +17,31 @@ Cpu::Cpu() {
     this->accumulator = 0;
     this->x = 0;
     this->y = 0;
-    this->p = 0;
+    this->set_status(0);
     this->stack_pointer = 0;
+    this->opcode = 0;
+    this->operand = 0;
     this->cycles = 0;
     this->iterations = 0;
-    this->is_processing_interrupt = false;
-    this->page_crossed = false;
-    this->addressing_mode = AddressingMode::none;
+    this->interrupts = nullptr;
+    this->decoded_rom.fill({0, 0, false, LoopKind::unknown, 0});
+    this->run_target = 0;
+    this->idle_loop_branch = 0;
+    this->idle_loop_cycles = 0;
+    this->idle_loop_iterations = 0;
+    this->block_lookup.fill(nullptr);
+    this->recompiled_rom_matches = false;
 }
 
 void Cpu::connect_bus(Bus *bus) {
     this->bus = bus;
+    this->interrupts = &bus->interrupts;
 }
 
 void Cpu::prepare_for_nestest() {
     this->program_counter = 0xc000;
     this->stack_pointer = 0xfd;
-    this->p = 0x24;
+    this->set_status(0x24);
     this->cycles = 7;
 }
 
@@ -43,72 +54,101 @@ bool Cpu::check_if_page_crossed(uint16_t a, uint16_t b) {
     }
 }
 
+/* Zero and negative are kept as the result that last set them, and carry and overflow as plain bools, so setting them
+ * never has to read-modify-write p. They're only packed back into a status byte when something needs the whole thing. */
+
 void Cpu::set_processor_flag(ProcessorFlag flag, bool on) {
-    if(on) {
-        this->p |= static_cast<unsigned int>(flag);
-    }
-    else {
-        this->p &= ~static_cast<unsigned int>(flag);
+    switch(flag) {
+        case ProcessorFlag::carry:
+            this->carry = on;
+            break;
+        case ProcessorFlag::zero:
+            this->zero_result = !on;
+            break;
+        case ProcessorFlag::overflow:
+            this->overflow = on;
+            break;
+        case ProcessorFlag::negative:
+            this->negative_result = on ? 0x80 : 0;
+            break;
+        default:
+            if(on) {
+                this->p |= static_cast<unsigned int>(flag);
+            }
+            else {
+                this->p &= ~static_cast<unsigned int>(flag);
+            }
     }
 }
 
 bool Cpu::read_processor_flag(ProcessorFlag flag) {
-    return this->p & static_cast<unsigned int>(flag);
+    switch(flag) {
+        case ProcessorFlag::carry:
+            return this->carry;
+        case ProcessorFlag::zero:
+            return this->zero_result == 0;
+        case ProcessorFlag::overflow:
+            return this->overflow;
+        case ProcessorFlag::negative:
+            return this->negative_result & 0x80;
+        default:
+            return this->p & static_cast<unsigned int>(flag);
+    }
 }
 
-/* Addressing mode helper functions */
+void Cpu::set_zero_negative(uint8_t result) {
+    this->zero_result = result;
+    this->negative_result = result;
+}
 
-uint16_t Cpu::address_immediate() {
-    return this->program_counter + 1;
+uint8_t Cpu::get_status() {
+    return this->p |
+           this->carry |
+           (this->zero_result == 0) << 1 |
+           this->overflow << 6 |
+           (this->negative_result & 0x80);
 }
 
+void Cpu::set_status(uint8_t status) {
+    this->p = status & ~LAZY_FLAGS;
+    this->carry = status & static_cast<unsigned int>(ProcessorFlag::carry);
+    this->zero_result = ~status & static_cast<unsigned int>(ProcessorFlag::zero);
+    this->overflow = status & static_cast<unsigned int>(ProcessorFlag::overflow);
+    this->negative_result = status & static_cast<unsigned int>(ProcessorFlag::negative);
+}
+
+/* Addressing mode helper functions */
+
 uint16_t Cpu::address_zero_page() {
-    return this->bus->read_ram(this->program_counter + 1);
+    return this->operand & 0xff;
 }
 
 uint16_t Cpu::address_zero_page_x() {
-    uint8_t zero_page = this->bus->read_ram(this->program_counter + 1);
+    uint8_t zero_page = this->operand;
     zero_page += this->x;
     return static_cast<uint16_t>(zero_page);
 }
 
 uint16_t Cpu::address_zero_page_y() {
-    uint8_t zero_page = this->bus->read_ram(this->program_counter + 1);
+    uint8_t zero_page = this->operand;
     zero_page += this->y;
     return static_cast<uint16_t>(zero_page);
 }
 
 uint16_t Cpu::address_absolute() {
-    return this->bus->read_ram_16(this->program_counter + 1);
-}
-
-uint16_t Cpu::address_absolute_x() {
-    uint16_t address = this->bus->read_ram_16(this->program_counter + 1);
-    if(this->check_if_page_crossed(address, address + this->x)) {
-        this->page_crossed = true;
-    }
-    return address + this->x;
-}
-
-uint16_t Cpu::address_absolute_y() {
-    uint16_t address = this->bus->read_ram_16(this->program_counter + 1);
-    if(this->check_if_page_crossed(address, address + this->y)) {
-        this->page_crossed = true;
-    }
-    return address + this->y;
+    return this->operand;
 }
 
 uint16_t Cpu::address_indirect() {
-    uint16_t address_absolute = this->bus->read_ram_16(this->program_counter + 1);
-    return this->bus->read_ram_16(address_absolute);
+    return this->bus->read_ram_16(this->operand);
 }
 
 uint16_t Cpu::address_indirect_hardware_bug() {
     /* An original 6502 does not correctly fetch the target address if the indirect vector falls on a page boundary
      * (e.g. $xxFF where xx is any value from $00 to $FF). In this case fetches the LSB from $xxFF as expected but
      * takes the MSB from $xx00. http://obelisk.me.uk/6502/reference.html#JMP */
-    uint8_t absolute_higher = this->bus->read_ram(this->program_counter + 2);
-    uint8_t absolute_lower = this->bus->read_ram(this->program_counter + 1);
+    uint8_t absolute_higher = this->operand >> 8;
+    uint8_t absolute_lower = this->operand & 0xff;
     uint16_t absolute_a = absolute_higher << 8 | absolute_lower;
     //Wrap around the page boundary (page = 256 bytes) by overflowing the lower 8 bits of the address if it's 0xff.
     absolute_lower++;
@@ -121,70 +161,99 @@ uint16_t Cpu::address_indexed_indirect() {
     /* We cannot use read16 here because the zero page address needs to wrap around to the bottom of the page if
      * the address is 0xff. The parameter gets everything after the first 8 bits masked off since the read ram
      * function will interpret it as a 16bit value otherwise.*/
-    uint8_t zero_page = this->bus->read_ram(this->program_counter + 1);
+    uint8_t zero_page = this->operand;
     zero_page += this->x;
     uint16_t address = this->bus->read_ram((zero_page + 1) & 0xff) << 8;
     address |= this->bus->read_ram(zero_page);
     return address;
 }
 
-uint16_t Cpu::address_indirect_indexed() {
-    uint8_t zero_page = this->bus->read_ram(this->program_counter + 1);
+uint16_t Cpu::address_zero_page_pointer() {
+    uint8_t zero_page = this->operand;
     uint16_t  address = this->bus->read_ram((zero_page + 1) & 0xff) << 8;
     address |= this->bus->read_ram(zero_page);
-    if(this->check_if_page_crossed(address, address + this->y)) {
-        this->page_crossed = true;
+    return address;
+}
+
+/* Indexed modes take an extra cycle when the index carries into the high byte, but only for opcodes that just read
+ * the operand. Stores and read-modify-write opcodes always pay for the fix up cycle, it's part of their base cost. */
+template<bool page_cross_penalty>
+uint16_t Cpu::index_address(uint16_t base, uint8_t index) {
+    uint16_t address = base + index;
+    if constexpr(page_cross_penalty) {
+        this->cycles += this->check_if_page_crossed(base, address);
     }
-    return address + this->y;
+    return address;
 }
 
+template<Cpu::AddressingMode mode, bool page_cross_penalty>
 uint16_t Cpu::resolve_address() {
-    switch(this->addressing_mode) {
-        case AddressingMode::immediate:
-            return this->address_immediate();
-        case AddressingMode::zero_page:
-            return this->address_zero_page();
-        case AddressingMode::zero_page_x:
-            return this->address_zero_page_x();
-        case AddressingMode::zero_page_y:
-            return this->address_zero_page_y();
-        case AddressingMode::absolute:
-            return this->address_absolute();
-        case AddressingMode::absolute_x:
-            return this->address_absolute_x();
-        case AddressingMode::absolute_y:
-            return this->address_absolute_y();
-        case AddressingMode::indirect:
-            return this->address_indirect();
-        case AddressingMode::indirect_hardware_bug:
-            return this->address_indirect_hardware_bug();
-        case AddressingMode::indexed_indirect:
-            return this->address_indexed_indirect();
-        case AddressingMode::indirect_indexed:
-            return this->address_indirect_indexed();
-        case AddressingMode::none:
-            assert("Tried to resolve address without an addressing mode" && 1 == 0);
+    static_assert(mode != AddressingMode::accumulator &&
+                  mode != AddressingMode::immediate &&
+                  mode != AddressingMode::relative &&
+                  mode != AddressingMode::none, "Tried to resolve address without an addressing mode");
+    if constexpr(mode == AddressingMode::zero_page) {
+        return this->address_zero_page();
+    }
+    else if constexpr(mode == AddressingMode::zero_page_x) {
+        return this->address_zero_page_x();
+    }
+    else if constexpr(mode == AddressingMode::zero_page_y) {
+        return this->address_zero_page_y();
+    }
+    else if constexpr(mode == AddressingMode::absolute) {
+        return this->address_absolute();
+    }
+    else if constexpr(mode == AddressingMode::absolute_x) {
+        return this->index_address<page_cross_penalty>(this->address_absolute(), this->x);
+    }
+    else if constexpr(mode == AddressingMode::absolute_y) {
+        return this->index_address<page_cross_penalty>(this->address_absolute(), this->y);
+    }
+    else if constexpr(mode == AddressingMode::indirect) {
+        return this->address_indirect();
+    }
+    else if constexpr(mode == AddressingMode::indirect_hardware_bug) {
+        return this->address_indirect_hardware_bug();
+    }
+    else if constexpr(mode == AddressingMode::indexed_indirect) {
+        return this->address_indexed_indirect();
+    }
+    else {
+        return this->index_address<page_cross_penalty>(this->address_zero_page_pointer(), this->y);
+    }
+}
+
+template<Cpu::AddressingMode mode>
+uint8_t Cpu::read_operand() {
+    if constexpr(mode == AddressingMode::immediate) {
+        return this->operand;
+    }
+    else {
+        return this->bus->read_ram(this->resolve_address<mode, true>());
     }
 }
 
 /* Helper functions for branch opcodes*/
 
 int8_t Cpu::relative_offset() {
-    return static_cast<int8_t>(this->bus->read_ram(this->program_counter + 1));
+    return static_cast<int8_t>(this->operand);
 }
 
-bool Cpu::branch(bool b) {
+void Cpu::branch(bool b) {
     if(b) {
         int8_t offset = this->relative_offset();
+        this->cycles += 1;
         //The + 2 is needed because the branch opcode will increase the pc by 2 regardless if the branch is taken.
         if(this->check_if_page_crossed(this->program_counter + 2, static_cast<uint16_t>(this->program_counter + offset))) {
-            this->page_crossed = true;
+            this->cycles += 2;
+        }
+        #if defined(CPU_IDLE_LOOP_SKIP) || defined(CPU_LOOP_IDIOMS)
+        if(offset < 0) {
+            this->take_backward_branch(this->program_counter + 2 + offset);
         }
+        #endif
         this->program_counter += offset;
-        return true;
-    }
-    else {
-        return false;
     }
 }
 
@@ -215,213 +284,277 @@ uint16_t Cpu::pop_16() {
 /* Reset interrupt */
 
 void Cpu::reset() {
-    this->p = 0x34;
+    this->set_status(0x34);
     this->accumulator, this->x, this->y = 0;
     this->stack_pointer = 0xfd;
     this->program_counter = this->bus->read_ram_16(RESET_INTERRUPT_VECTOR);
-    this->is_processing_interrupt = false;
+    this->interrupts->release_line(InterruptLines::Line::nmi);
+    this->invalidate_decoded_rom();
+    for(int window = 0; window < Rom::PRGROM_WINDOWS; window++) {
+        this->decoded_banks[window] = this->bus->rom->get_prgrom_bank(window * PRGROM_WINDOW_SIZE);
+    }
+    this->translated_blocks.clear();
+    this->block_lookup.fill(nullptr);
+    #ifdef CPU_RECOMPILED_ROM
+    //The generated code reads PRG-ROM at fixed addresses, so it's only used for roms that can't switch banks.
+    this->recompiled_rom_matches = this->bus->rom->get_mapper_number() == Mapper::NROM &&
+                                   this->hash_prgrom() == RECOMPILED_PRGROM_HASH;
+    #endif
 }
 
 void Cpu::nmi_interrupt() {
     this->push_16(this->program_counter);
-    this->push(this->p);
+    this->push(this->get_status());
     this->set_processor_flag(ProcessorFlag::interrupt, true);
     this->program_counter = this->bus->read_ram_16(NMI_INTERRUPT_VECTOR);
 }
 
+void Cpu::irq_interrupt() {
+    this->push_16(this->program_counter);
+    this->push(this->get_status());
+    this->set_processor_flag(ProcessorFlag::interrupt, true);
+    this->program_counter = this->bus->read_ram_16(IRQ_INTERRUPT_VECTOR);
+}
+
 /* Opcodes start here */
 
-void Cpu::ADC(bool SBC) {
-    uint16_t address = this->resolve_address();
-    uint8_t value = this->bus->read_ram(address);
-    if(SBC)
-        value = ~value;
-    unsigned int sum = this->accumulator + value + this->read_processor_flag(ProcessorFlag::carry);
-    this->set_processor_flag(ProcessorFlag::carry, sum > 0xff);
-    this->set_processor_flag(ProcessorFlag::overflow, (this->accumulator ^ sum) & (value ^ sum) & 0x80);
+void Cpu::add_with_carry(uint8_t value) {
+    unsigned int sum = this->accumulator + value + this->carry;
+    this->carry = sum > 0xff;
+    this->overflow = (this->accumulator ^ sum) & (value ^ sum) & 0x80;
     this->accumulator = sum;
-    this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+    this->set_zero_negative(this->accumulator);
 }
 
+template<Cpu::AddressingMode mode>
+void Cpu::ADC() {
+    this->add_with_carry(this->read_operand<mode>());
+}
+
+template<Cpu::AddressingMode mode>
 void Cpu::AND() {
-    uint16_t address = this->resolve_address();
-    uint8_t value = this->bus->read_ram(address);
+    uint8_t value = this->read_operand<mode>();
     this->accumulator &= value;
-    this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+    this->set_zero_negative(this->accumulator);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::ASL() {
-    if(this->addressing_mode == AddressingMode::accumulator) {
+    if constexpr(mode == AddressingMode::accumulator) {
         bool old_bit_seven = this->accumulator & 0x80;
         this->accumulator <<= 1;
-        this->set_processor_flag(ProcessorFlag::carry, old_bit_seven);
-        this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-        this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+        this->carry = old_bit_seven;
+        this->set_zero_negative(this->accumulator);
     }
     else {
-        uint16_t address = this->resolve_address();
+        uint16_t address = this->resolve_address<mode>();
         uint8_t value = this->bus->read_ram(address);
         bool old_bit_seven = value & 0x80;
         value <<= 1;
-        this->set_processor_flag(ProcessorFlag::carry, old_bit_seven);
-        this->set_processor_flag(ProcessorFlag::zero, value == 0);
-        this->set_processor_flag(ProcessorFlag::negative, value & 0x80);
+        this->carry = old_bit_seven;
+        this->set_zero_negative(value);
         this->bus->write_ram(address, value);
     }
 }
 
+void Cpu::BCC() {
+    this->branch(!this->read_processor_flag(ProcessorFlag::carry));
+}
+
+void Cpu::BCS() {
+    this->branch(this->read_processor_flag(ProcessorFlag::carry));
+}
+
+void Cpu::BEQ() {
+    this->branch(this->read_processor_flag(ProcessorFlag::zero));
+}
+
+template<Cpu::AddressingMode mode>
 void Cpu::BIT() {
-    uint16_t address = this->resolve_address();
-    uint8_t value = this->bus->read_ram(address);
+    uint8_t value = this->read_operand<mode>();
     uint8_t result = value & this->accumulator;
-    this->set_processor_flag(ProcessorFlag::zero, result == 0);
-    this->set_processor_flag(ProcessorFlag::overflow, value & 0b01000000);
-    this->set_processor_flag(ProcessorFlag::negative, value & 0x80);
+    this->zero_result = result;
+    this->overflow = value & 0b01000000;
+    this->negative_result = value;
+}
+
+void Cpu::BMI() {
+    this->branch(this->read_processor_flag(ProcessorFlag::negative));
+}
+
+void Cpu::BNE() {
+    this->branch(!this->read_processor_flag(ProcessorFlag::zero));
+}
+
+void Cpu::BPL() {
+    this->branch(!this->read_processor_flag(ProcessorFlag::negative));
 }
 
+//The I flag doesn't mask BRK. It returns past the byte after the opcode, and the status it pushes has B set.
 void Cpu::BRK() {
-    this->push_16(this->program_counter);
-    this->push(this->p);
-    this->program_counter = this->bus->read_ram_16(0xfffe);
-    this->set_processor_flag(ProcessorFlag::_break, true);
+    this->push_16(this->program_counter + 2);
+    this->push(this->get_status() | 0b00010000);
     this->set_processor_flag(ProcessorFlag::interrupt, true);
+    this->program_counter = this->bus->read_ram_16(IRQ_INTERRUPT_VECTOR);
 }
 
+void Cpu::BVC() {
+    this->branch(!this->read_processor_flag(ProcessorFlag::overflow));
+}
+
+void Cpu::BVS() {
+    this->branch(this->read_processor_flag(ProcessorFlag::overflow));
+}
+
+void Cpu::CLC() {
+    this->set_processor_flag(ProcessorFlag::carry, false);
+}
+
+void Cpu::CLD() {
+    this->set_processor_flag(ProcessorFlag::decimal, false);
+}
+
+void Cpu::CLI() {
+    this->set_processor_flag(ProcessorFlag::interrupt, false);
+}
+
+void Cpu::CLV() {
+    this->set_processor_flag(ProcessorFlag::overflow, false);
+}
+
+template<Cpu::AddressingMode mode>
 void Cpu::CMP() {
-    uint16_t address = this->resolve_address();
-    uint8_t value = this->bus->read_ram(address);
-    this->set_processor_flag(ProcessorFlag::carry, this->accumulator >= value);
-    this->set_processor_flag(ProcessorFlag::zero, this->accumulator == value);
-    this->set_processor_flag(ProcessorFlag::negative, (this->accumulator - value) & 0x80);
+    uint8_t value = this->read_operand<mode>();
+    this->carry = this->accumulator >= value;
+    this->set_zero_negative(this->accumulator - value);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::CPX() {
-    uint16_t address = this->resolve_address();
-    uint8_t value = this->bus->read_ram(address);
-    this->set_processor_flag(ProcessorFlag::carry, this->x >= value);
-    this->set_processor_flag(ProcessorFlag::zero, this->x == value);
-    this->set_processor_flag(ProcessorFlag::negative, (this->x - value) & 0x80);
+    uint8_t value = this->read_operand<mode>();
+    this->carry = this->x >= value;
+    this->set_zero_negative(this->x - value);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::CPY() {
-    uint16_t address = this->resolve_address();
-    uint8_t value = this->bus->read_ram(address);
-    this->set_processor_flag(ProcessorFlag::carry, this->y >= value);
-    this->set_processor_flag(ProcessorFlag::zero, this->y == value);
-    this->set_processor_flag(ProcessorFlag::negative, (this->y - value) & 0x80);
+    uint8_t value = this->read_operand<mode>();
+    this->carry = this->y >= value;
+    this->set_zero_negative(this->y - value);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::DEC() {
-    uint16_t address = this->resolve_address();
+    uint16_t address = this->resolve_address<mode>();
     uint8_t value = this->bus->read_ram(address);
     value--;
-    this->set_processor_flag(ProcessorFlag::zero, value == 0);
-    this->set_processor_flag(ProcessorFlag::negative, value & 0x80);
+    this->set_zero_negative(value);
     this->bus->write_ram(address, value);
 }
 
 void Cpu::DEX() {
     this->x--;
-    this->set_processor_flag(ProcessorFlag::zero, this->x == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->x & 0x80);
+    this->set_zero_negative(this->x);
 }
 
 void Cpu::DEY() {
     this->y--;
-    this->set_processor_flag(ProcessorFlag::zero, this->y == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->y & 0x80);
+    this->set_zero_negative(this->y);
 }
 
-void Cpu::EOR(){
-    uint16_t address = this->resolve_address();
-    uint8_t value = this->bus->read_ram(address);
+template<Cpu::AddressingMode mode>
+void Cpu::EOR() {
+    uint8_t value = this->read_operand<mode>();
     this->accumulator ^= value;
-    this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+    this->set_zero_negative(this->accumulator);
 }
 
-void Cpu::INC(){
-    uint16_t address = this->resolve_address();
+template<Cpu::AddressingMode mode>
+void Cpu::INC() {
+    uint16_t address = this->resolve_address<mode>();
     uint8_t value = this->bus->read_ram(address);
     value++;
-    this->set_processor_flag(ProcessorFlag::zero, value == 0);
-    this->set_processor_flag(ProcessorFlag::negative, value & 0x80);
+    this->set_zero_negative(value);
     this->bus->write_ram(address, value);
 
 }
 
 void Cpu::INX(){
     this->x++;
-    this->set_processor_flag(ProcessorFlag::zero, this->x == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->x & 0x80);
+    this->set_zero_negative(this->x);
 }
 
 void Cpu::INY() {
     this->y++;
-    this->set_processor_flag(ProcessorFlag::zero, this->y == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->y & 0x80);
+    this->set_zero_negative(this->y);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::JMP() {
-    uint16_t address = this->resolve_address();
+    uint16_t address = this->resolve_address<mode>();
+    #if defined(CPU_IDLE_LOOP_SKIP) || defined(CPU_LOOP_IDIOMS)
+    if constexpr(mode == AddressingMode::absolute) {
+        if(address <= this->program_counter) {
+            this->take_backward_branch(address);
+        }
+    }
+    #endif
     this->program_counter = address;
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::JSR() {
     this->push_16(this->program_counter + 2);
-    uint16_t address = this->resolve_address();
+    uint16_t address = this->resolve_address<mode>();
     this->program_counter = address;
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::LDA() {
-    uint16_t address = this->resolve_address();
-    this->accumulator = this->bus->read_ram(address);
-    this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+    this->accumulator = this->read_operand<mode>();
+    this->set_zero_negative(this->accumulator);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::LDX() {
-    uint16_t address = this->resolve_address();
-    this->x = this->bus->read_ram(address);
-    this->set_processor_flag(ProcessorFlag::zero, this->x == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->x & 0x80);
+    this->x = this->read_operand<mode>();
+    this->set_zero_negative(this->x);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::LDY() {
-    uint16_t address = this->resolve_address();
-    this->y = this->bus->read_ram(address);
-    this->set_processor_flag(ProcessorFlag::zero, this->y == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->y & 0x80);
+    this->y = this->read_operand<mode>();
+    this->set_zero_negative(this->y);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::LSR() {
-    if(this->addressing_mode == AddressingMode::accumulator) {
+    if constexpr(mode == AddressingMode::accumulator) {
         bool old_bit_zero = this->accumulator & 0b1;
         this->accumulator >>= 1;
-        set_processor_flag(ProcessorFlag::carry, old_bit_zero);
-        set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
+        this->carry = old_bit_zero;
+        this->set_zero_negative(this->accumulator);
     }
     else {
-        uint16_t address = this->resolve_address();
+        uint16_t address = this->resolve_address<mode>();
         uint8_t value = this->bus->read_ram(address);
         bool old_bit_zero = value & 0b1;
         value >>= 1;
         this->bus->write_ram(address, value);
-        this->set_processor_flag(ProcessorFlag::carry, old_bit_zero);
-        this->set_processor_flag(ProcessorFlag::zero, value == 0);
+        this->carry = old_bit_zero;
+        this->set_zero_negative(value);
     }
-    this->set_processor_flag(ProcessorFlag::negative, false);
 
 }
 
+void Cpu::NOP() {
+}
+
+template<Cpu::AddressingMode mode>
 void Cpu::ORA() {
-    uint16_t address = this->resolve_address();
-    uint8_t value = this->bus->read_ram(address);
+    uint8_t value = this->read_operand<mode>();
     this->accumulator |= value;
-    this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+    this->set_zero_negative(this->accumulator);
 }
 
 void Cpu::PHA() {
@@ -429,113 +562,126 @@ void Cpu::PHA() {
 }
 
 void Cpu::PHP() {
-    this->push(this->p | 0b00010000);
+    this->push(this->get_status() | 0b00010000);
 }
 
 void Cpu::PLA() {
     this->accumulator = this->pop();
-    this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+    this->set_zero_negative(this->accumulator);
 }
 
 void Cpu::PLP() {
-    this->p = this->pop() & 0b11101111  | 0b00100000;
+    this->set_status(this->pop() & 0b11101111  | 0b00100000);
 }
 
-void Cpu::ROL(){
-    if(this->addressing_mode == AddressingMode::accumulator) {
+template<Cpu::AddressingMode mode>
+void Cpu::ROL() {
+    if constexpr(mode == AddressingMode::accumulator) {
         bool old_bit_seven = this->accumulator & 0x80;
         this->accumulator <<= 1;
-        this->accumulator |= this->read_processor_flag(ProcessorFlag::carry);
-        this->set_processor_flag(ProcessorFlag::carry, old_bit_seven);
-        this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-        this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+        this->accumulator |= this->carry;
+        this->carry = old_bit_seven;
+        this->set_zero_negative(this->accumulator);
     }
     else {
-        uint16_t address = this->resolve_address();
+        uint16_t address = this->resolve_address<mode>();
         uint8_t value = this->bus->read_ram(address);
         bool old_bit_seven = value & 0x80;
         value <<= 1;
-        value |= this->read_processor_flag(ProcessorFlag::carry);
-        this->set_processor_flag(ProcessorFlag::carry, old_bit_seven);
-        this->set_processor_flag(ProcessorFlag::zero, value == 0);
-        this->set_processor_flag(ProcessorFlag::negative, value & 0x80);
+        value |= this->carry;
+        this->carry = old_bit_seven;
+        this->set_zero_negative(value);
         this->bus->write_ram(address, value);
     }
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::ROR() {
-    if(this->addressing_mode == AddressingMode::accumulator) {
+    if constexpr(mode == AddressingMode::accumulator) {
         bool old_bit_zero = this->accumulator & 0b1;
         this->accumulator >>= 1;
-        this->accumulator |= this->read_processor_flag(ProcessorFlag::carry) << 7;
-        this->set_processor_flag(ProcessorFlag::carry, old_bit_zero);
-        this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-        this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+        this->accumulator |= this->carry << 7;
+        this->carry = old_bit_zero;
+        this->set_zero_negative(this->accumulator);
     }
     else {
-        uint16_t address = this->resolve_address();
+        uint16_t address = this->resolve_address<mode>();
         uint8_t value = this->bus->read_ram(address);
         bool old_bit_zero = value & 0b1;
         value >>= 1;
-        value |= this->read_processor_flag(ProcessorFlag::carry) << 7;
-        this->set_processor_flag(ProcessorFlag::carry, old_bit_zero);
-        this->set_processor_flag(ProcessorFlag::zero, value == 0);
-        this->set_processor_flag(ProcessorFlag::negative, value & 0x80);
+        value |= this->carry << 7;
+        this->carry = old_bit_zero;
+        this->set_zero_negative(value);
         this->bus->write_ram(address, value);
     }
 }
 
 void Cpu::RTI() {
-    this->p = this->pop() & 0xef | 0x20;
+    this->set_status(this->pop() & 0xef | 0x20);
     this->program_counter = this->pop_16();
+    #ifdef CPU_DEBUG_OUTPUT
+    std::cout << "Returning from interrupt" << std::endl;
+    #endif
 }
 
 void Cpu::RTS() {
-    this->program_counter = this->pop_16();
+    //JSR pushes the address of the last byte of its operand, so the return address is one past that.
+    this->program_counter = this->pop_16() + 1;
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::SBC() {
-    this->ADC(true);
+    this->add_with_carry(~this->read_operand<mode>());
+}
+
+void Cpu::SEC() {
+    this->set_processor_flag(ProcessorFlag::carry, true);
+}
+
+void Cpu::SED() {
+    this->set_processor_flag(ProcessorFlag::decimal, true);
+}
+
+void Cpu::SEI() {
+    this->set_processor_flag(ProcessorFlag::interrupt, true);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::STA() {
-    uint16_t address = this->resolve_address();
+    uint16_t address = this->resolve_address<mode>();
     this->bus->write_ram(address, this->accumulator);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::STX() {
-    uint16_t address = this->resolve_address();
+    uint16_t address = this->resolve_address<mode>();
     this->bus->write_ram(address, this->x);
 }
 
+template<Cpu::AddressingMode mode>
 void Cpu::STY() {
-    uint16_t address = this->resolve_address();
+    uint16_t address = this->resolve_address<mode>();
     this->bus->write_ram(address, this->y);
 }
 
 void Cpu::TAX() {
     this->x = this->accumulator;
-    this->set_processor_flag(ProcessorFlag::zero, this->x == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->x & 0x80);
+    this->set_zero_negative(this->x);
 }
 
 void Cpu::TAY() {
     this->y = this->accumulator;
-    this->set_processor_flag(ProcessorFlag::zero, this->y == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->y & 0x80);
+    this->set_zero_negative(this->y);
 }
 
 void Cpu::TSX() {
     this->x = this->stack_pointer;
-    this->set_processor_flag(ProcessorFlag::zero, this->x == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->x & 0x80);
+    this->set_zero_negative(this->x);
 }
 
 void Cpu::TXA(){
     this->accumulator = this->x;
-    this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+    this->set_zero_negative(this->accumulator);
 }
 
 void Cpu::TXS(){
@@ -544,1055 +690,833 @@ void Cpu::TXS(){
 
 void Cpu::TYA(){
     this->accumulator = this->y;
-    this->set_processor_flag(ProcessorFlag::zero, this->accumulator == 0);
-    this->set_processor_flag(ProcessorFlag::negative, this->accumulator & 0x80);
+    this->set_zero_negative(this->accumulator);
 }
 
-void Cpu::run_for(int cycles) {
-    int cycle_counter = 0;
-    while(cycle_counter < cycles) {
-        this->addressing_mode = AddressingMode::none;
-        this->page_crossed = false;
+void Cpu::illegal_opcode() {
+    assert("Invalid opcode" && 1 == 0);
+}
+
+/* Opcode table */
+
+constexpr std::array<Cpu::Instruction, 256> Cpu::build_instruction_table() {
+    std::array<Instruction, 256> table{};
+    for(auto &instruction : table) {
+        instruction = {&Cpu::illegal_opcode, AddressingMode::none, 1, 2, false, false};
+    }
+    //ADC
+    table[0x69] = {&Cpu::ADC<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0x65] = {&Cpu::ADC<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0x75] = {&Cpu::ADC<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, false};
+    table[0x6d] = {&Cpu::ADC<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    table[0x7d] = {&Cpu::ADC<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 4, false, false};
+    table[0x79] = {&Cpu::ADC<AddressingMode::absolute_y>, AddressingMode::absolute_y, 3, 4, false, false};
+    table[0x61] = {&Cpu::ADC<AddressingMode::indexed_indirect>, AddressingMode::indexed_indirect, 2, 6, false, false};
+    table[0x71] = {&Cpu::ADC<AddressingMode::indirect_indexed>, AddressingMode::indirect_indexed, 2, 5, false, false};
+    //AND
+    table[0x29] = {&Cpu::AND<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0x25] = {&Cpu::AND<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0x35] = {&Cpu::AND<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, false};
+    table[0x2d] = {&Cpu::AND<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    table[0x3d] = {&Cpu::AND<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 4, false, false};
+    table[0x39] = {&Cpu::AND<AddressingMode::absolute_y>, AddressingMode::absolute_y, 3, 4, false, false};
+    table[0x21] = {&Cpu::AND<AddressingMode::indexed_indirect>, AddressingMode::indexed_indirect, 2, 6, false, false};
+    table[0x31] = {&Cpu::AND<AddressingMode::indirect_indexed>, AddressingMode::indirect_indexed, 2, 5, false, false};
+    //ASL
+    table[0x0a] = {&Cpu::ASL<AddressingMode::accumulator>, AddressingMode::accumulator, 1, 2, false, false};
+    table[0x06] = {&Cpu::ASL<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 5, false, true};
+    table[0x16] = {&Cpu::ASL<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 6, false, true};
+    table[0x0e] = {&Cpu::ASL<AddressingMode::absolute>, AddressingMode::absolute, 3, 6, false, true};
+    table[0x1e] = {&Cpu::ASL<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 7, false, true};
+    //BCC
+    table[0x90] = {&Cpu::BCC, AddressingMode::relative, 2, 2, false, false};
+    //BCS
+    table[0xb0] = {&Cpu::BCS, AddressingMode::relative, 2, 2, false, false};
+    //BEQ
+    table[0xf0] = {&Cpu::BEQ, AddressingMode::relative, 2, 2, false, false};
+    //BIT
+    table[0x24] = {&Cpu::BIT<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0x2c] = {&Cpu::BIT<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    //BMI
+    table[0x30] = {&Cpu::BMI, AddressingMode::relative, 2, 2, false, false};
+    //BNE
+    table[0xd0] = {&Cpu::BNE, AddressingMode::relative, 2, 2, false, false};
+    //BPL
+    table[0x10] = {&Cpu::BPL, AddressingMode::relative, 2, 2, false, false};
+    //BRK
+    table[0x00] = {&Cpu::BRK, AddressingMode::none, 1, 7, true, false};
+    //BVC
+    table[0x50] = {&Cpu::BVC, AddressingMode::relative, 2, 2, false, false};
+    //BVS
+    table[0x70] = {&Cpu::BVS, AddressingMode::relative, 2, 2, false, false};
+    //CLC
+    table[0x18] = {&Cpu::CLC, AddressingMode::none, 1, 2, false, false};
+    //CLD
+    table[0xd8] = {&Cpu::CLD, AddressingMode::none, 1, 2, false, false};
+    //CLI
+    table[0x58] = {&Cpu::CLI, AddressingMode::none, 1, 2, false, false};
+    //CLV
+    table[0xb8] = {&Cpu::CLV, AddressingMode::none, 1, 2, false, false};
+    //CMP
+    table[0xc9] = {&Cpu::CMP<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0xc5] = {&Cpu::CMP<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0xd5] = {&Cpu::CMP<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, false};
+    table[0xcd] = {&Cpu::CMP<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    table[0xdd] = {&Cpu::CMP<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 4, false, false};
+    table[0xd9] = {&Cpu::CMP<AddressingMode::absolute_y>, AddressingMode::absolute_y, 3, 4, false, false};
+    table[0xc1] = {&Cpu::CMP<AddressingMode::indexed_indirect>, AddressingMode::indexed_indirect, 2, 6, false, false};
+    table[0xd1] = {&Cpu::CMP<AddressingMode::indirect_indexed>, AddressingMode::indirect_indexed, 2, 5, false, false};
+    //CPX
+    table[0xe0] = {&Cpu::CPX<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0xe4] = {&Cpu::CPX<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0xec] = {&Cpu::CPX<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    //CPY
+    table[0xc0] = {&Cpu::CPY<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0xc4] = {&Cpu::CPY<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0xcc] = {&Cpu::CPY<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    //DEC
+    table[0xc6] = {&Cpu::DEC<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 5, false, true};
+    table[0xd6] = {&Cpu::DEC<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 6, false, true};
+    table[0xce] = {&Cpu::DEC<AddressingMode::absolute>, AddressingMode::absolute, 3, 6, false, true};
+    table[0xde] = {&Cpu::DEC<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 7, false, true};
+    //DEX
+    table[0xca] = {&Cpu::DEX, AddressingMode::none, 1, 2, false, false};
+    //DEY
+    table[0x88] = {&Cpu::DEY, AddressingMode::none, 1, 2, false, false};
+    //EOR
+    table[0x49] = {&Cpu::EOR<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0x45] = {&Cpu::EOR<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0x55] = {&Cpu::EOR<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, false};
+    table[0x4d] = {&Cpu::EOR<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    table[0x5d] = {&Cpu::EOR<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 4, false, false};
+    table[0x59] = {&Cpu::EOR<AddressingMode::absolute_y>, AddressingMode::absolute_y, 3, 4, false, false};
+    table[0x41] = {&Cpu::EOR<AddressingMode::indexed_indirect>, AddressingMode::indexed_indirect, 2, 6, false, false};
+    table[0x51] = {&Cpu::EOR<AddressingMode::indirect_indexed>, AddressingMode::indirect_indexed, 2, 5, false, false};
+    //INC
+    table[0xe6] = {&Cpu::INC<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 5, false, true};
+    table[0xf6] = {&Cpu::INC<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 6, false, true};
+    table[0xee] = {&Cpu::INC<AddressingMode::absolute>, AddressingMode::absolute, 3, 6, false, true};
+    table[0xfe] = {&Cpu::INC<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 7, false, true};
+    //INX
+    table[0xe8] = {&Cpu::INX, AddressingMode::none, 1, 2, false, false};
+    //INY
+    table[0xc8] = {&Cpu::INY, AddressingMode::none, 1, 2, false, false};
+    //JMP
+    table[0x4c] = {&Cpu::JMP<AddressingMode::absolute>, AddressingMode::absolute, 3, 3, true, false};
+    table[0x6c] = {&Cpu::JMP<AddressingMode::indirect_hardware_bug>, AddressingMode::indirect_hardware_bug, 3, 5, true, false};
+    //JSR
+    table[0x20] = {&Cpu::JSR<AddressingMode::absolute>, AddressingMode::absolute, 3, 6, true, false};
+    //LDA
+    table[0xa9] = {&Cpu::LDA<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0xa5] = {&Cpu::LDA<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0xb5] = {&Cpu::LDA<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, false};
+    table[0xad] = {&Cpu::LDA<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    table[0xbd] = {&Cpu::LDA<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 4, false, false};
+    table[0xb9] = {&Cpu::LDA<AddressingMode::absolute_y>, AddressingMode::absolute_y, 3, 4, false, false};
+    table[0xa1] = {&Cpu::LDA<AddressingMode::indexed_indirect>, AddressingMode::indexed_indirect, 2, 6, false, false};
+    table[0xb1] = {&Cpu::LDA<AddressingMode::indirect_indexed>, AddressingMode::indirect_indexed, 2, 5, false, false};
+    //LDX
+    table[0xa2] = {&Cpu::LDX<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0xa6] = {&Cpu::LDX<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0xb6] = {&Cpu::LDX<AddressingMode::zero_page_y>, AddressingMode::zero_page_y, 2, 4, false, false};
+    table[0xae] = {&Cpu::LDX<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    table[0xbe] = {&Cpu::LDX<AddressingMode::absolute_y>, AddressingMode::absolute_y, 3, 4, false, false};
+    //LDY
+    table[0xa0] = {&Cpu::LDY<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0xa4] = {&Cpu::LDY<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0xb4] = {&Cpu::LDY<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, false};
+    table[0xac] = {&Cpu::LDY<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    table[0xbc] = {&Cpu::LDY<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 4, false, false};
+    //LSR
+    table[0x4a] = {&Cpu::LSR<AddressingMode::accumulator>, AddressingMode::accumulator, 1, 2, false, false};
+    table[0x46] = {&Cpu::LSR<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 5, false, true};
+    table[0x56] = {&Cpu::LSR<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 6, false, true};
+    table[0x4e] = {&Cpu::LSR<AddressingMode::absolute>, AddressingMode::absolute, 3, 6, false, true};
+    table[0x5e] = {&Cpu::LSR<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 7, false, true};
+    //NOP
+    table[0xea] = {&Cpu::NOP, AddressingMode::none, 1, 2, false, false};
+    //ORA
+    table[0x09] = {&Cpu::ORA<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0x05] = {&Cpu::ORA<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0x15] = {&Cpu::ORA<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, false};
+    table[0x0d] = {&Cpu::ORA<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    table[0x1d] = {&Cpu::ORA<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 4, false, false};
+    table[0x19] = {&Cpu::ORA<AddressingMode::absolute_y>, AddressingMode::absolute_y, 3, 4, false, false};
+    table[0x01] = {&Cpu::ORA<AddressingMode::indexed_indirect>, AddressingMode::indexed_indirect, 2, 6, false, false};
+    table[0x11] = {&Cpu::ORA<AddressingMode::indirect_indexed>, AddressingMode::indirect_indexed, 2, 5, false, false};
+    //PHA
+    table[0x48] = {&Cpu::PHA, AddressingMode::none, 1, 3, false, false};
+    //PHP
+    table[0x08] = {&Cpu::PHP, AddressingMode::none, 1, 3, false, false};
+    //PLA
+    table[0x68] = {&Cpu::PLA, AddressingMode::none, 1, 4, false, false};
+    //PLP
+    table[0x28] = {&Cpu::PLP, AddressingMode::none, 1, 4, false, false};
+    //ROL
+    table[0x2a] = {&Cpu::ROL<AddressingMode::accumulator>, AddressingMode::accumulator, 1, 2, false, false};
+    table[0x26] = {&Cpu::ROL<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 5, false, true};
+    table[0x36] = {&Cpu::ROL<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 6, false, true};
+    table[0x2e] = {&Cpu::ROL<AddressingMode::absolute>, AddressingMode::absolute, 3, 6, false, true};
+    table[0x3e] = {&Cpu::ROL<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 7, false, true};
+    //ROR
+    table[0x6a] = {&Cpu::ROR<AddressingMode::accumulator>, AddressingMode::accumulator, 1, 2, false, false};
+    table[0x66] = {&Cpu::ROR<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 5, false, true};
+    table[0x76] = {&Cpu::ROR<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 6, false, true};
+    table[0x6e] = {&Cpu::ROR<AddressingMode::absolute>, AddressingMode::absolute, 3, 6, false, true};
+    table[0x7e] = {&Cpu::ROR<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 7, false, true};
+    //RTI
+    table[0x40] = {&Cpu::RTI, AddressingMode::none, 1, 6, true, false};
+    //RTS
+    table[0x60] = {&Cpu::RTS, AddressingMode::none, 1, 6, true, false};
+    //SBC
+    table[0xe9] = {&Cpu::SBC<AddressingMode::immediate>, AddressingMode::immediate, 2, 2, false, false};
+    table[0xe5] = {&Cpu::SBC<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, false};
+    table[0xf5] = {&Cpu::SBC<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, false};
+    table[0xed] = {&Cpu::SBC<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, false};
+    table[0xfd] = {&Cpu::SBC<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 4, false, false};
+    table[0xf9] = {&Cpu::SBC<AddressingMode::absolute_y>, AddressingMode::absolute_y, 3, 4, false, false};
+    table[0xe1] = {&Cpu::SBC<AddressingMode::indexed_indirect>, AddressingMode::indexed_indirect, 2, 6, false, false};
+    table[0xf1] = {&Cpu::SBC<AddressingMode::indirect_indexed>, AddressingMode::indirect_indexed, 2, 5, false, false};
+    //SEC
+    table[0x38] = {&Cpu::SEC, AddressingMode::none, 1, 2, false, false};
+    //SED
+    table[0xf8] = {&Cpu::SED, AddressingMode::none, 1, 2, false, false};
+    //SEI
+    table[0x78] = {&Cpu::SEI, AddressingMode::none, 1, 2, false, false};
+    //STA
+    table[0x85] = {&Cpu::STA<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, true};
+    table[0x95] = {&Cpu::STA<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, true};
+    table[0x8d] = {&Cpu::STA<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, true};
+    table[0x9d] = {&Cpu::STA<AddressingMode::absolute_x>, AddressingMode::absolute_x, 3, 5, false, true};
+    table[0x99] = {&Cpu::STA<AddressingMode::absolute_y>, AddressingMode::absolute_y, 3, 5, false, true};
+    table[0x81] = {&Cpu::STA<AddressingMode::indexed_indirect>, AddressingMode::indexed_indirect, 2, 6, false, true};
+    table[0x91] = {&Cpu::STA<AddressingMode::indirect_indexed>, AddressingMode::indirect_indexed, 2, 6, false, true};
+    //STX
+    table[0x86] = {&Cpu::STX<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, true};
+    table[0x96] = {&Cpu::STX<AddressingMode::zero_page_y>, AddressingMode::zero_page_y, 2, 4, false, true};
+    table[0x8e] = {&Cpu::STX<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, true};
+    //STY
+    table[0x84] = {&Cpu::STY<AddressingMode::zero_page>, AddressingMode::zero_page, 2, 3, false, true};
+    table[0x94] = {&Cpu::STY<AddressingMode::zero_page_x>, AddressingMode::zero_page_x, 2, 4, false, true};
+    table[0x8c] = {&Cpu::STY<AddressingMode::absolute>, AddressingMode::absolute, 3, 4, false, true};
+    //TAX
+    table[0xaa] = {&Cpu::TAX, AddressingMode::none, 1, 2, false, false};
+    //TAY
+    table[0xa8] = {&Cpu::TAY, AddressingMode::none, 1, 2, false, false};
+    //TSX
+    table[0xba] = {&Cpu::TSX, AddressingMode::none, 1, 2, false, false};
+    //TXA
+    table[0x8a] = {&Cpu::TXA, AddressingMode::none, 1, 2, false, false};
+    //TXS
+    table[0x9a] = {&Cpu::TXS, AddressingMode::none, 1, 2, false, false};
+    //TYA
+    table[0x98] = {&Cpu::TYA, AddressingMode::none, 1, 2, false, false};
+    return table;
+}
+
+constexpr std::array<Cpu::Instruction, 256> Cpu::INSTRUCTIONS = Cpu::build_instruction_table();
+
+/* Instruction fetch */
+
+uint16_t Cpu::fetch_operand(uint16_t address, uint8_t opcode) {
+    switch(INSTRUCTIONS[opcode].length) {
+        case 2:
+            return this->bus->read_ram(address + 1);
+        case 3:
+            return this->bus->read_ram_16(address + 1);
+        default:
+            return 0;
+    }
+}
+
+const Cpu::DecodedInstruction &Cpu::decode_rom_instruction(uint16_t address) {
+    DecodedInstruction &decoded = this->decoded_rom[address - Bus::ROM_START];
+    if(!decoded.decoded) {
+        decoded.opcode = this->bus->read_ram(address);
+        decoded.operand = this->fetch_operand(address, decoded.opcode);
+        //An operand that wraps around past $ffff comes from ram, so that instruction has to be fetched every time.
+        decoded.decoded = address + INSTRUCTIONS[decoded.opcode].length - 1 <= Bus::ROM_END;
+        decoded.loop_kind = LoopKind::unknown;
+    }
+    return decoded;
+}
+
+void Cpu::invalidate_decoded_rom(uint16_t start, uint16_t end) {
+    for(int address = start; address <= end; address++) {
+        this->decoded_rom[address - Bus::ROM_START].decoded = false;
+        this->decoded_rom[address - Bus::ROM_START].loop_kind = LoopKind::unknown;
+    }
+}
+
+void Cpu::trace_instruction() {
+    #ifdef CPU_DEBUG_OUTPUT
+    int opcode_length = get_opcode_length(this->opcode);
+    std::array<uint8_t, 3> args;
+    for(int i = this->program_counter + 1, e = 0; i < this->program_counter + opcode_length; i++, e++) {
+        args.at(e) = this->bus->read_ram(i);
+    }
+    print_debug_info(this->program_counter, this->opcode, opcode_length, args, this->accumulator, this->y, this->x, this->get_status(),
+                     this->stack_pointer, this->cycles, this->iterations);
+    #endif
+    #ifdef NESTEST
+    debug_nestest_log_compare(this->program_counter, this->opcode, this->accumulator, this->y, this->x, this->get_status(),
+                              this->stack_pointer, this->cycles, this->iterations);
+    #endif
+}
+
+void Cpu::fetch_instruction() {
+    if(this->program_counter >= Bus::ROM_START) {
+        const DecodedInstruction &decoded = this->decode_rom_instruction(this->program_counter);
+        this->opcode = decoded.opcode;
+        this->operand = decoded.operand;
+    }
+    else {
         this->opcode = this->bus->read_ram(this->program_counter);
+        this->operand = this->fetch_operand(this->program_counter, this->opcode);
+    }
+    this->trace_instruction();
+}
+
+inline void Cpu::execute_instruction(const Instruction &instruction) {
+    (this->*instruction.handler)();
+    if(!instruction.sets_program_counter) {
+        this->program_counter += instruction.length;
+    }
+    this->cycles += instruction.cycles;
+}
+
+//True if an interrupt would be taken at some point without anything else happening first, whether or not it's due yet.
+bool Cpu::interrupt_pending() {
+    return this->interrupts->is_pending(InterruptLines::Line::nmi) ||
+           (this->interrupts->is_pending(InterruptLines::Line::irq) &&
+            !this->read_processor_flag(ProcessorFlag::interrupt));
+}
+
+void Cpu::service_interrupts() {
+    if(this->interrupts->is_due(InterruptLines::Line::nmi, this->cycles)) {
         #ifdef CPU_DEBUG_OUTPUT
-        int opcode_length = get_opcode_length(this->opcode);
-        std::array<uint8_t, 3> args;
-        for(int i = this->program_counter + 1, e = 0; i < this->program_counter + opcode_length; i++, e++) {
-            args.at(e) = this->bus->read_ram(i);
+        std::cout << "Entering NMI" << std::endl;
+        #endif
+        this->interrupts->release_line(InterruptLines::Line::nmi);
+        this->nmi_interrupt();
+    }
+    else if(this->interrupts->is_due(InterruptLines::Line::irq, this->cycles) &&
+            !this->read_processor_flag(ProcessorFlag::interrupt))
+    {
+        #ifdef CPU_DEBUG_OUTPUT
+        std::cout << "Entering IRQ" << std::endl;
+        #endif
+        this->irq_interrupt();
+    }
+}
+
+//The cpu is halted while the DMA unit copies a page to OAM, one more cycle if it has to wait for a read cycle first.
+void Cpu::stall_for_oam_dma() {
+    this->cycles += OAM_DMA_CYCLES + (this->cycles & 1);
+    this->bus->clear_event(Bus::Event::oam_dma);
+}
+
+/* A mapper write that switched PRG-ROM banks leaves the decoded instructions of the old banks behind. Only the windows
+ * that now show another bank are thrown away, along with the last couple of bytes before each one, since an
+ * instruction there could have taken its operand from the old bank. */
+void Cpu::handle_bus_events() {
+    if(this->bus->has_event(Bus::Event::oam_dma)) {
+        this->stall_for_oam_dma();
+    }
+    if(this->bus->has_event(Bus::Event::prgrom_switched)) {
+        this->bus->clear_event(Bus::Event::prgrom_switched);
+        for(int window = 0; window < Rom::PRGROM_WINDOWS; window++) {
+            int bank = this->bus->rom->get_prgrom_bank(window * PRGROM_WINDOW_SIZE);
+            if(bank == this->decoded_banks[window]) {
+                continue;
+            }
+            int start = std::max(Bus::ROM_START + window * PRGROM_WINDOW_SIZE - 2, int(Bus::ROM_START));
+            this->invalidate_decoded_rom(start, Bus::ROM_START + (window + 1) * PRGROM_WINDOW_SIZE - 1);
+            this->decoded_banks[window] = bank;
         }
-        print_debug_info(this->program_counter, this->opcode, opcode_length, args, this->accumulator, this->y, this->x, this->p,
-                         this->stack_pointer, this->cycles, this->iterations);
+    }
+}
+
+void Cpu::finish_instruction() {
+    if(this->bus->events != 0) {
+        this->handle_bus_events();
+    }
+    if(this->interrupts->any_pending()) {
+        this->service_interrupts();
+    }
+    this->iterations++;
+}
+
+/* Basic block translation */
+
+bool Cpu::may_access_io(const Instruction &instruction, uint16_t operand) {
+    int first, last;
+    switch(instruction.addressing_mode) {
+        case AddressingMode::absolute:
+            first = operand;
+            last = operand;
+            break;
+        case AddressingMode::absolute_x:
+        case AddressingMode::absolute_y:
+            first = operand;
+            last = operand + 0xff;
+            break;
+        case AddressingMode::indirect:
+        case AddressingMode::indirect_hardware_bug:
+        case AddressingMode::indexed_indirect:
+        case AddressingMode::indirect_indexed:
+            return true;
+        default:
+            return false;
+    }
+    //Reading PRG-ROM is harmless, but writing to it talks to the mapper.
+    int io_end = instruction.writes_memory ? Bus::ROM_END : Bus::ROM_START - 1;
+    return last >= Bus::PPU_ADDRESS_START && first <= io_end;
+}
+
+Cpu::TranslatedBlock Cpu::translate_block(uint16_t address, int bank) {
+    TranslatedBlock block{address, bank, 0, {}};
+    int window = address / PRGROM_WINDOW_SIZE;
+    int cycles_before_last = 0;
+    for(int length = 0; length < MAX_BLOCK_LENGTH; length++) {
+        const DecodedInstruction &decoded = this->decode_rom_instruction(address);
+        const Instruction &instruction = INSTRUCTIONS[decoded.opcode];
+        //Instructions that straddle a bank window or wrap around into ram are left to the interpreter.
+        if(!decoded.decoded || (address + instruction.length - 1) / PRGROM_WINDOW_SIZE != window) {
+            break;
+        }
+        block.steps.push_back({&instruction, decoded.operand, decoded.opcode});
+        /* Every instruction in the block has to start before the cycle target, same as when interpreting. Reads can
+         * take one extra cycle for crossing a page, so budget for that on every instruction but the last one. */
+        block.cycle_budget = cycles_before_last;
+        cycles_before_last += instruction.cycles + 1;
+        if(instruction.sets_program_counter ||
+           instruction.addressing_mode == AddressingMode::relative ||
+           instruction.handler == &Cpu::illegal_opcode ||
+           this->may_access_io(instruction, decoded.operand)) {
+            break;
+        }
+        address += instruction.length;
+        if(address < Bus::ROM_START || address / PRGROM_WINDOW_SIZE != window) {
+            break;
+        }
+    }
+    return block;
+}
+
+Cpu::TranslatedBlock &Cpu::find_block(uint16_t address) {
+    int bank = this->bus->rom->get_prgrom_bank(address - Bus::ROM_START);
+    TranslatedBlock *&cached = this->block_lookup[address % BLOCK_LOOKUP_SIZE];
+    if(cached == nullptr || cached->address != address || cached->bank != bank) {
+        uint32_t key = static_cast<uint32_t>(bank) << 16 | address;
+        auto found = this->translated_blocks.find(key);
+        if(found == this->translated_blocks.end()) {
+            found = this->translated_blocks.emplace(key, this->translate_block(address, bank)).first;
+        }
+        cached = &found->second;
+    }
+    return *cached;
+}
+
+bool Cpu::run_translated_block(uint64_t target) {
+    /* A pending interrupt is taken after the next instruction, and only the interpreter checks between instructions.
+     * Only the last step of a block can touch the PPU, controller or mapper registers, so nothing before it can raise
+     * an interrupt or switch a bank. Whatever that last access does is caught up on by finish_instruction, after the
+     * block returns, the same as after an interpreted instruction. */
+    if(this->program_counter < Bus::ROM_START || this->interrupt_pending()) {
+        return false;
+    }
+    TranslatedBlock &block = this->find_block(this->program_counter);
+    if(block.steps.empty() || this->cycles + block.cycle_budget >= target) {
+        return false;
+    }
+    for(const auto &step : block.steps) {
+        this->opcode = step.opcode;
+        this->operand = step.operand;
+        this->trace_instruction();
+        this->execute_instruction(*step.instruction);
+    }
+    this->iterations += block.steps.size() - 1;
+    this->finish_instruction();
+    return true;
+}
+
+/* Loop skipping */
+
+//Loads, compares and BIT, which leave the same registers and flags behind every time they run on the same memory.
+bool Cpu::is_idle_read(uint8_t opcode, uint16_t operand) {
+    switch(opcode) {
+        //LDA
+        case 0xa9: case 0xa5: case 0xb5: case 0xad: case 0xbd: case 0xb9:
+        //LDX
+        case 0xa2: case 0xa6: case 0xb6: case 0xae: case 0xbe:
+        //LDY
+        case 0xa0: case 0xa4: case 0xb4: case 0xac: case 0xbc:
+        //CMP
+        case 0xc9: case 0xc5: case 0xd5: case 0xcd: case 0xdd: case 0xd9:
+        //CPX
+        case 0xe0: case 0xe4: case 0xec:
+        //CPY
+        case 0xc0: case 0xc4: case 0xcc:
+        //BIT
+        case 0x24: case 0x2c:
+        //NOP
+        case 0xea:
+            break;
+        default:
+            return false;
+    }
+    //Reading ram, PRG-ROM or the ppu status register has no side effects, everything else might.
+    switch(INSTRUCTIONS[opcode].addressing_mode) {
+        case AddressingMode::absolute:
+            return operand <= Bus::RAM_ADDRESS_END ||
+                   operand >= Bus::ROM_START ||
+                   (operand <= Bus::PPU_ADDRESS_END && (operand & 0x2007) == Ppu::PPU_STATUS);
+        case AddressingMode::absolute_x:
+        case AddressingMode::absolute_y:
+            return operand + 0xff <= Bus::RAM_ADDRESS_END || operand >= Bus::ROM_START;
+        default:
+            return true;
+    }
+}
+
+/* Taking apart a loop that ends in a taken backward branch. The body is only looked at when it's in PRG-ROM and fits
+ * inside one bank window, so it can't change under us without the decoded rom being invalidated. */
+Cpu::LoopIdiom Cpu::match_loop(uint16_t start, uint16_t end) {
+    LoopIdiom loop{LoopKind::other, 0, false, 0, false, 0, 0, {}};
+    if(start < Bus::ROM_START || start / PRGROM_WINDOW_SIZE != end / PRGROM_WINDOW_SIZE) {
+        return loop;
+    }
+    std::array<DecodedInstruction, MAX_LOOP_LENGTH> body;
+    int length = 0;
+    for(uint16_t address = start; address != end; length++) {
+        if(address > end || length == MAX_LOOP_LENGTH - 1) {
+            return loop;
+        }
+        const DecodedInstruction &decoded = this->decode_rom_instruction(address);
+        if(!decoded.decoded) {
+            return loop;
+        }
+        body[length] = decoded;
+        address += INSTRUCTIONS[decoded.opcode].length;
+    }
+    loop.length = length + 1;
+    bool idle = true;
+    for(int i = 0; i < length; i++) {
+        idle = idle && this->is_idle_read(body[i].opcode, body[i].operand);
+    }
+    if(idle) {
+        loop.kind = LoopKind::idle;
+        return loop;
+    }
+    //Counting loops step x or y, optionally compare it against an immediate, then BNE back to the start.
+    if(this->decoded_rom[end - Bus::ROM_START].opcode != OPCODE_BNE) {
+        return loop;
+    }
+    bool compare_y = false;
+    if(length > 0 && (body[length - 1].opcode == OPCODE_CPX_IMMEDIATE ||
+                      body[length - 1].opcode == OPCODE_CPY_IMMEDIATE))
+    {
+        loop.compare = true;
+        loop.compare_value = body[length - 1].operand;
+        compare_y = body[length - 1].opcode == OPCODE_CPY_IMMEDIATE;
+        length--;
+    }
+    if(length == 0) {
+        return loop;
+    }
+    switch(body[length - 1].opcode) {
+        case OPCODE_INX:
+            loop.step = 1;
+            break;
+        case OPCODE_DEX:
+            loop.step = -1;
+            break;
+        case OPCODE_INY:
+            loop.step = 1;
+            loop.counter_y = true;
+            break;
+        case OPCODE_DEY:
+            loop.step = -1;
+            loop.counter_y = true;
+            break;
+        default:
+            return loop;
+    }
+    length--;
+    if(length == 0 || (loop.compare && compare_y != loop.counter_y)) {
+        return loop;
+    }
+    loop.data_length = length;
+    std::copy(body.begin(), body.begin() + length, loop.data.begin());
+    //STA base,X over and over, writing nothing but ram.
+    bool fill = true;
+    for(int i = 0; i < length; i++) {
+        const DecodedInstruction &store = body[i];
+        fill = fill && ((store.opcode == OPCODE_STA_ZERO_PAGE_X && !loop.counter_y) ||
+                        (store.opcode == OPCODE_STA_ABSOLUTE_X && !loop.counter_y) ||
+                        (store.opcode == OPCODE_STA_ABSOLUTE_Y && loop.counter_y));
+        fill = fill && (store.opcode == OPCODE_STA_ZERO_PAGE_X || store.operand + 0xff <= Bus::RAM_ADDRESS_END);
+    }
+    if(fill) {
+        loop.kind = LoopKind::fill;
+        return loop;
+    }
+    //LDA source,X then STA $2007, where the source is ram or PRG-ROM.
+    if(length == 2 &&
+       body[1].opcode == OPCODE_STA_ABSOLUTE &&
+       body[1].operand >= Bus::PPU_ADDRESS_START && body[1].operand <= Bus::PPU_ADDRESS_END &&
+       (body[1].operand & Bus::PPU_ADDRESS_MAX_BITS) == Ppu::PPU_DATA)
+    {
+        const DecodedInstruction &load = body[0];
+        bool source_in_memory = load.operand + 0xff <= Bus::RAM_ADDRESS_END || load.operand >= Bus::ROM_START;
+        if((load.opcode == OPCODE_LDA_ZERO_PAGE_X && !loop.counter_y) ||
+           (load.opcode == OPCODE_LDA_ABSOLUTE_X && !loop.counter_y && source_in_memory) ||
+           (load.opcode == OPCODE_LDA_ABSOLUTE_Y && loop.counter_y && source_in_memory) ||
+           (load.opcode == OPCODE_LDA_INDIRECT_INDEXED && loop.counter_y))
+        {
+            loop.kind = LoopKind::upload;
+        }
+    }
+    return loop;
+}
+
+/* Called from a taken backward branch or jump before it moves the program counter. */
+void Cpu::take_backward_branch(uint16_t start) {
+    if(this->program_counter < Bus::ROM_START) {
+        return;
+    }
+    DecodedInstruction &branch = this->decoded_rom[this->program_counter - Bus::ROM_START];
+    if(branch.loop_kind == LoopKind::unknown) {
+        LoopIdiom loop = this->match_loop(start, this->program_counter);
+        branch.loop_kind = loop.kind;
+        branch.loop_length = loop.length;
+    }
+    switch(branch.loop_kind) {
+        #ifdef CPU_IDLE_LOOP_SKIP
+        case LoopKind::idle:
+            this->skip_idle_loop(branch.loop_length);
+            break;
         #endif
-        #ifdef NESTEST
-        debug_nestest_log_compare(this->program_counter, this->opcode, this->accumulator, this->y, this->x, this->p,
-                                  this->stack_pointer, this->cycles, this->iterations);
+        #ifdef CPU_LOOP_IDIOMS
+        case LoopKind::fill:
+        case LoopKind::upload:
+            this->run_loop_idiom(this->match_loop(start, this->program_counter));
+            break;
         #endif
-        int cycles_before_next_instruction = this->cycles;
-        switch(this->opcode) {
-            //ADC
-            case 0x69:
-                this->addressing_mode = AddressingMode::immediate;
-                this->ADC();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0x65:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->ADC();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0x75:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->ADC();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0x6d:
-                this->addressing_mode = AddressingMode::absolute;
-                this->ADC();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0x7d:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->ADC();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0x79:
-                this->addressing_mode = AddressingMode::absolute_y;
-                this->ADC();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0x61:
-                this->addressing_mode = AddressingMode::indexed_indirect;
-                this->ADC();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0x71:
-                this->addressing_mode = AddressingMode::indirect_indexed;
-                this->ADC();
-                this->program_counter += 2;
-                this->cycles += 5;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-                //AND
-            case 0x29:
-                this->addressing_mode = AddressingMode::immediate;
-                this->AND();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0x25:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->AND();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0x35:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->AND();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0x2d:
-                this->addressing_mode = AddressingMode::absolute;
-                this->AND();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0x3d:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->AND();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0x39:
-                this->addressing_mode = AddressingMode::absolute_y;
-                this->AND();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0x21:
-                this->addressing_mode = AddressingMode::indexed_indirect;
-                this->AND();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0x31:
-                this->addressing_mode = AddressingMode::indirect_indexed;
-                this->AND();
-                this->program_counter += 2;
-                this->cycles += 5;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-                //ASL
-            case 0x0a:
-                this->addressing_mode = AddressingMode::accumulator;
-                this->ASL();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-            case 0x06:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->ASL();
-                this->program_counter += 2;
-                this->cycles += 5;
-                break;
-            case 0x16:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->ASL();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0x0e:
-                this->addressing_mode = AddressingMode::absolute;
-                this->ASL();
-                this->program_counter += 3;
-                this->cycles += 6;
-                break;
-            case 0x1e:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->ASL();
-                this->program_counter += 3;
-                this->cycles += 7;
-                break;
-                //BCC
-            case 0x90:
-                if(this->branch(!this->read_processor_flag(ProcessorFlag::carry))) {
-                    this->cycles += 1;
-                }
-                this->program_counter += 2;
-                this->cycles += 2;
-                if(this->page_crossed)
-                    this->cycles += 2;
-                break;
-                //BCS
-            case 0xb0:
-                if(this->branch(this->read_processor_flag(ProcessorFlag::carry))) {
-                    this->cycles += 1;
-                }
-                this->program_counter += 2;
-                this->cycles += 2;
-                if(this->page_crossed)
-                    this->cycles += 2;
-                break;
-                //BEQ
-            case 0xf0:
-                if(this->branch(this->read_processor_flag(ProcessorFlag::zero))) {
-                    this->cycles += 1;
-                }
-                this->program_counter += 2;
-                this->cycles += 2;
-                if(this->page_crossed)
-                    this->cycles += 2;
-                break;
-                //BIT
-            case 0x24:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->BIT();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0x2c:
-                this->addressing_mode = AddressingMode::absolute;
-                this->BIT();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-                //BMI
-            case 0x30:
-                if(this->branch(this->read_processor_flag(ProcessorFlag::negative))) {
-                    this->cycles += 1;
-                }
-                this->program_counter += 2;
-                this->cycles += 2;
-                if(this->page_crossed)
-                    this->cycles += 2;
-                break;
-                //BNE
-            case 0xd0:
-                if(this->branch(!this->read_processor_flag(ProcessorFlag::zero))) {
-                    this->cycles += 1;
-                }
-                this->program_counter += 2;
-                this->cycles += 2;
-                if(this->page_crossed)
-                    this->cycles += 2;
-                break;
-                //BPL
-            case 0x10:
-                if(this->branch(!this->read_processor_flag(ProcessorFlag::negative))) {
-                    this->cycles += 1;
-                }
-                this->program_counter += 2;
-                this->cycles += 2;
-                if(this->page_crossed)
-                    this->cycles += 2;
-                break;
-                //BRK
-            case 0x00:
-                if(!this->is_processing_interrupt && !this->read_processor_flag(ProcessorFlag::interrupt)) {
-                    this->BRK();
-                    this->cycles += 7;
-                }
-                assert(1==0);
-                break;
-                //BVC
-            case 0x50:
-                if(this->branch(!this->read_processor_flag(ProcessorFlag::overflow))) {
-                    this->cycles += 1;
-                }
-                this->program_counter += 2;
-                this->cycles += 2;
-                if(this->page_crossed)
-                    this->cycles += 2;
-                break;
-                //BVS
-            case 0x70:
-                if(this->branch(this->read_processor_flag(ProcessorFlag::overflow))) {
-                    this->cycles += 1;
-                }
-                this->program_counter += 2;
-                this->cycles += 2;
-                if(this->page_crossed)
-                    this->cycles += 2;
-                break;
-                //CLC
-            case 0x18:
-                this->set_processor_flag(ProcessorFlag::carry, false);
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //CLD
-            case 0xd8:
-                this->set_processor_flag(ProcessorFlag::decimal, false);
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //CLI
-            case 0x58:
-                this->set_processor_flag(ProcessorFlag::interrupt, false);
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //CLV
-            case 0xb8:
-                this->set_processor_flag(ProcessorFlag::overflow, false);
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //CMP
-            case 0xc9:
-                this->addressing_mode = AddressingMode::immediate;
-                this->CMP();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0xc5:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->CMP();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0xd5:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->CMP();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0xcd:
-                this->addressing_mode = AddressingMode::absolute;
-                this->CMP();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0xdd:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->CMP();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0xd9:
-                this->addressing_mode = AddressingMode::absolute_y;
-                this->CMP();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0xc1:
-                this->addressing_mode = AddressingMode::indexed_indirect;
-                this->CMP();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0xd1:
-                this->addressing_mode = AddressingMode::indirect_indexed;
-                this->CMP();
-                this->program_counter += 2;
-                this->cycles += 5;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-                //CPX
-            case 0xe0:
-                this->addressing_mode = AddressingMode::immediate;
-                this->CPX();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0xe4:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->CPX();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0xec:
-                this->addressing_mode = AddressingMode::absolute;
-                this->CPX();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-                //CPY
-            case 0xc0:
-                this->addressing_mode = AddressingMode::immediate;
-                this->CPY();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0xc4:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->CPY();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0xcc:
-                this->addressing_mode = AddressingMode::absolute;
-                this->CPY();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-                //DEC
-            case 0xc6:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->DEC();
-                this->program_counter += 2;
-                this->cycles += 5;
-                break;
-            case 0xd6:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->DEC();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0xce:
-                this->addressing_mode = AddressingMode::absolute;
-                this->DEC();
-                this->program_counter += 3;
-                this->cycles += 6;
-                break;
-            case 0xde:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->DEC();
-                this->program_counter += 3;
-                this->cycles += 7;
-                break;
-                //DEX
-            case 0xca:
-                this->DEX();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //DEY
-            case 0x88:
-                this->DEY();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //EOR
-            case 0x49:
-                this->addressing_mode = AddressingMode::immediate;
-                this->EOR();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0x45:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->EOR();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0x55:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->EOR();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0x4d:
-                this->addressing_mode = AddressingMode::absolute;
-                this->EOR();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0x5d:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->EOR();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0x59:
-                this->addressing_mode = AddressingMode::absolute_y;
-                this->EOR();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0x41:
-                this->addressing_mode = AddressingMode::indexed_indirect;
-                this->EOR();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0x51:
-                this->addressing_mode = AddressingMode::indirect_indexed;
-                this->EOR();
-                this->program_counter += 2;
-                this->cycles += 5;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-                //INC
-            case 0xe6:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->INC();
-                this->program_counter += 2;
-                this->cycles += 5;
-                break;
-            case 0xf6:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->INC();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0xee:
-                this->addressing_mode = AddressingMode::absolute;
-                this->INC();
-                this->program_counter += 3;
-                this->cycles += 6;
-                break;
-            case 0xfe:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->INC();
-                this->program_counter += 3;
-                this->cycles += 7;
-                break;
-                //INX
-            case 0xe8:
-                this->INX();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //INY
-            case 0xc8:
-                this->INY();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //JMP
-            case 0x4c:
-                this->addressing_mode = AddressingMode::absolute;
-                this->JMP();
-                this->cycles += 3;
-                break;
-            case 0x6c:
-                this->addressing_mode = AddressingMode::indirect_hardware_bug;
-                this->JMP();
-                this->cycles += 5;
-                break;
-                //JSR
-            case 0x20:
-                this->addressing_mode = AddressingMode::absolute;
-                this->JSR();
-                this->cycles += 6;
-                break;
-                //LDA
-            case 0xa9:
-                this->addressing_mode = AddressingMode::immediate;
-                this->LDA();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0xa5:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->LDA();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0xb5:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->LDA();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0xad:
-                this->addressing_mode = AddressingMode::absolute;
-                this->LDA();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0xbd:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->LDA();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0xb9:
-                this->addressing_mode = AddressingMode::absolute_y;
-                this->LDA();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0xa1:
-                this->addressing_mode = AddressingMode::indexed_indirect;
-                this->LDA();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0xb1:
-                this->addressing_mode = AddressingMode::indirect_indexed;
-                this->LDA();
-                this->program_counter += 2;
-                this->cycles += 5;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-                //LDX
-            case 0xa2:
-                this->addressing_mode = AddressingMode::immediate;
-                this->LDX();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0xa6:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->LDX();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0xb6:
-                this->addressing_mode = AddressingMode::zero_page_y;
-                this->LDX();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0xae:
-                this->addressing_mode = AddressingMode::absolute;
-                this->LDX();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0xbe:
-                this->addressing_mode = AddressingMode::absolute_y;
-                this->LDX();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-                //LDY
-            case 0xa0:
-                this->addressing_mode = AddressingMode::immediate;
-                this->LDY();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0xa4:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->LDY();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0xb4:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->LDY();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0xac:
-                this->addressing_mode = AddressingMode::absolute;
-                this->LDY();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0xbc:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->LDY();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-                //LSR
-            case 0x4a:
-                this->addressing_mode = AddressingMode::accumulator;
-                this->LSR();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-            case 0x46:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->LSR();
-                this->program_counter += 2;
-                this->cycles += 5;
-                break;
-            case 0x56:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->LSR();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0x4e:
-                this->addressing_mode = AddressingMode::absolute;
-                this->LSR();
-                this->program_counter += 3;
-                this->cycles += 6;
-                break;
-            case 0x5e:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->LSR();
-                this->program_counter += 3;
-                this->cycles += 7;
-                break;
-                //NOP
-            case 0xea:
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //ORA
-            case 0x09:
-                this->addressing_mode = AddressingMode::immediate;
-                this->ORA();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0x05:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->ORA();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0x15:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->ORA();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0x0d:
-                this->addressing_mode = AddressingMode::absolute;
-                this->ORA();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0x1d:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->ORA();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0x19:
-                this->addressing_mode = AddressingMode::absolute_y;
-                this->ORA();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0x01:
-                this->addressing_mode = AddressingMode::indexed_indirect;
-                this->ORA();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0x11:
-                this->addressing_mode = AddressingMode::indirect_indexed;
-                this->ORA();
-                this->program_counter += 2;
-                this->cycles += 5;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-                //PHA
-            case 0x48:
-                this->PHA();
-                this->program_counter += 1;
-                this->cycles += 3;
-                break;
-                //PHP
-            case 0x08:
-                this->PHP();
-                this->program_counter += 1;
-                this->cycles += 3;
-                break;
-                //PLA
-            case 0x68:
-                this->PLA();
-                this->program_counter += 1;
-                this->cycles += 4;
-                break;
-                //PLP
-            case 0x28:
-                this->PLP();
-                this->program_counter += 1;
-                this->cycles += 4;
-                break;
-                //ROL
-            case 0x2a:
-                this->addressing_mode = AddressingMode::accumulator;
-                this->ROL();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-            case 0x26:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->ROL();
-                this->program_counter += 2;
-                this->cycles += 5;
-                break;
-            case 0x36:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->ROL();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0x2e:
-                this->addressing_mode = AddressingMode::absolute;
-                this->ROL();
-                this->program_counter += 3;
-                this->cycles += 6;
-                break;
-            case 0x3e:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->ROL();
-                this->program_counter += 3;
-                this->cycles += 7;
-                break;
-                //ROR
-            case 0x6a:
-                this->addressing_mode = AddressingMode::accumulator;
-                this->ROR();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-            case 0x66:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->ROR();
-                this->program_counter += 2;
-                this->cycles += 5;
-                break;
-            case 0x76:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->ROR();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0x6e:
-                this->addressing_mode = AddressingMode::absolute;
-                this->ROR();
-                this->program_counter += 3;
-                this->cycles += 6;
-                break;
-            case 0x7e:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->ROR();
-                this->program_counter += 3;
-                this->cycles += 7;
-                break;
-                //RTI
-            case 0x40:
-                this->RTI();
-                this->cycles += 6;
-                if(this->is_processing_interrupt) {
-                    #ifdef CPU_DEBUG_OUTPUT
-                    std::cout << "Returning from interrupt" << std::endl;
-                    #endif
-                    this->is_processing_interrupt = false;
+        default:
+            break;
+    }
+}
+
+/* A loop that only polls memory which nothing else can change before the end of the run leaves the cpu in exactly the
+ * same state after every pass, so once one full pass has been seen going from one take to the next, the remaining
+ * passes that fit before the run target are skipped by adding up their cycles. Whatever is left over is interpreted
+ * normally. */
+void Cpu::skip_idle_loop(uint8_t length) {
+    uint64_t loop_start = this->cycles + INSTRUCTIONS[this->opcode].cycles;
+    //An interrupt in between would show up as extra instructions, and a pending one has to be taken instead.
+    if(this->idle_loop_branch == this->program_counter &&
+       this->iterations - this->idle_loop_iterations == length &&
+       loop_start < this->run_target &&
+       !this->interrupt_pending())
+    {
+        uint64_t cost = loop_start - this->idle_loop_cycles;
+        uint64_t passes = (this->run_target - loop_start) / cost;
+        this->cycles += passes * cost;
+        this->iterations += passes * length;
+        loop_start += passes * cost;
+    }
+    this->idle_loop_branch = this->program_counter;
+    this->idle_loop_cycles = loop_start;
+    this->idle_loop_iterations = this->iterations;
+}
+
+/* Runs the remaining passes of a fill or upload loop directly against ram and the ppu, charging the same cycles the
+ * instructions would have taken. Only passes that end in another taken branch and that fit before the run target are
+ * done here, the last one is left to the interpreter so the branch falls through normally. */
+void Cpu::run_loop_idiom(const LoopIdiom &loop) {
+    if(this->interrupt_pending()) {
+        return;
+    }
+    uint8_t &counter = loop.counter_y ? this->y : this->x;
+    uint8_t end = loop.compare ? loop.compare_value : 0;
+    int passes = static_cast<uint8_t>(loop.step > 0 ? end - counter : counter - end) - 1;
+    int offset = this->relative_offset();
+    int pass_cycles = INSTRUCTIONS[OPCODE_INX].cycles + INSTRUCTIONS[OPCODE_BNE].cycles + 1;
+    if(this->check_if_page_crossed(this->program_counter + 2, static_cast<uint16_t>(this->program_counter + offset))) {
+        pass_cycles += 2;
+    }
+    if(loop.compare) {
+        pass_cycles += INSTRUCTIONS[OPCODE_CPX_IMMEDIATE].cycles;
+    }
+    for(int i = 0; i < loop.data_length; i++) {
+        pass_cycles += INSTRUCTIONS[loop.data[i].opcode].cycles;
+    }
+    uint64_t loop_start = this->cycles + INSTRUCTIONS[this->opcode].cycles;
+    if(passes <= 0 || loop_start + pass_cycles > this->run_target) {
+        return;
+    }
+    int done = 0;
+    if(loop.kind == LoopKind::fill) {
+        done = std::min<uint64_t>(passes, (this->run_target - loop_start) / pass_cycles);
+        uint8_t first = loop.step > 0 ? counter : counter - (done - 1);
+        for(int i = 0; i < loop.data_length; i++) {
+            const DecodedInstruction &store = loop.data[i];
+            bool zero_page = store.opcode == OPCODE_STA_ZERO_PAGE_X;
+            //Split wherever the index or the zero page address wraps around.
+            int index = first;
+            for(int remaining = done; remaining > 0;) {
+                uint16_t address = zero_page ? (store.operand + index) & 0xff : store.operand + index;
+                int chunk = std::min(remaining, 0x100 - index);
+                if(zero_page) {
+                    chunk = std::min(chunk, 0x100 - address);
                 }
-                break;
-                //RTS
-            case 0x60:
-                this->RTS();
-                this->program_counter += 1;
-                this->cycles += 6;
-                break;
-                //SBC
-            case 0xe9:
-                this->addressing_mode = AddressingMode::immediate;
-                this->SBC();
-                this->program_counter += 2;
-                this->cycles += 2;
-                break;
-            case 0xe5:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->SBC();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0xf5:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->SBC();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0xed:
-                this->addressing_mode = AddressingMode::absolute;
-                this->SBC();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0xfd:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->SBC();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0xf9:
-                this->addressing_mode = AddressingMode::absolute_y;
-                this->SBC();
-                this->program_counter += 3;
-                this->cycles += 4;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-            case 0xe1:
-                this->addressing_mode = AddressingMode::indexed_indirect;
-                this->SBC();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0xf1:
-                this->addressing_mode = AddressingMode::indirect_indexed;
-                this->SBC();
-                this->program_counter += 2;
-                this->cycles += 5;
-                if(this->page_crossed)
-                    this->cycles += 1;
-                break;
-                //SEC
-            case 0x38:
-                this->set_processor_flag(ProcessorFlag::carry, true);
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //SED
-            case 0xf8:
-                this->set_processor_flag(ProcessorFlag::decimal, true);
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //SEI
-            case 0x78:
-                this->set_processor_flag(ProcessorFlag::interrupt, true);
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //STA
-            case 0x85:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->STA();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0x95:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->STA();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0x8d:
-                this->addressing_mode = AddressingMode::absolute;
-                this->STA();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-            case 0x9d:
-                this->addressing_mode = AddressingMode::absolute_x;
-                this->STA();
-                this->program_counter += 3;
-                this->cycles += 5;
-                break;
-            case 0x99:
-                this->addressing_mode = AddressingMode::absolute_y;
-                this->STA();
-                this->program_counter += 3;
-                this->cycles += 5;
-                break;
-            case 0x81:
-                this->addressing_mode = AddressingMode::indexed_indirect;
-                this->STA();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-            case 0x91:
-                this->addressing_mode = AddressingMode::indirect_indexed;
-                this->STA();
-                this->program_counter += 2;
-                this->cycles += 6;
-                break;
-                //STX
-            case 0x86:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->STX();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0x96:
-                this->addressing_mode = AddressingMode::zero_page_y;
-                this->STX();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0x8e:
-                this->addressing_mode = AddressingMode::absolute;
-                this->STX();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-                //STY
-            case 0x84:
-                this->addressing_mode = AddressingMode::zero_page;
-                this->STY();
-                this->program_counter += 2;
-                this->cycles += 3;
-                break;
-            case 0x94:
-                this->addressing_mode = AddressingMode::zero_page_x;
-                this->STY();
-                this->program_counter += 2;
-                this->cycles += 4;
-                break;
-            case 0x8c:
-                this->addressing_mode = AddressingMode::absolute;
-                this->STY();
-                this->program_counter += 3;
-                this->cycles += 4;
-                break;
-                //TAX
-            case 0xaa:
-                this->TAX();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //TAY
-            case 0xa8:
-                this->TAY();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //TSX
-            case 0xba:
-                this->TSX();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //TXA
-            case 0x8a:
-                this->TXA();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //TXS
-            case 0x9a:
-                this->TXS();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-                //TYA
-            case 0x98:
-                this->TYA();
-                this->program_counter += 1;
-                this->cycles += 2;
-                break;
-            default:
-                assert(("Invalid opcode", 1 == 0));
+                this->bus->fill_ram(address, this->accumulator, chunk);
+                index = (index + chunk) & 0xff;
+                remaining -= chunk;
+            }
+        }
+        counter += loop.step * done;
+        this->cycles += static_cast<uint64_t>(done) * pass_cycles;
+    }
+    else {
+        const DecodedInstruction &load = loop.data[0];
+        uint16_t base = load.operand;
+        if(load.opcode == OPCODE_LDA_INDIRECT_INDEXED) {
+            base = this->bus->read_ram(load.operand) | this->bus->read_ram((load.operand + 1) & 0xff) << 8;
+            if(base + 0xff > Bus::RAM_ADDRESS_END && base < Bus::ROM_START) {
+                return;
+            }
         }
-        if(this->bus->ppu->poll_nmi_interrupt() && this->is_processing_interrupt == false) {
-            #ifdef CPU_DEBUG_OUTPUT
-            std::cout << "Entering NMI" << std::endl;
-            #endif
-            this->is_processing_interrupt = true;
-            this->nmi_interrupt();
+        bool zero_page = load.opcode == OPCODE_LDA_ZERO_PAGE_X;
+        for(; done < passes; done++) {
+            uint16_t source = zero_page ? (base + counter) & 0xff : base + counter;
+            int cycles = pass_cycles + (!zero_page && this->check_if_page_crossed(base, source));
+            if(loop_start + cycles > this->run_target) {
+                break;
+            }
+            this->accumulator = this->bus->read_ram(source);
+            this->bus->ppu->write_data(this->accumulator);
+            counter += loop.step;
+            this->cycles += cycles;
+            loop_start += cycles;
         }
-        this->iterations++;
-        cycle_counter += this->cycles - cycles_before_next_instruction;
     }
+    if(done == 0) {
+        return;
+    }
+    if(loop.compare) {
+        this->carry = counter >= loop.compare_value;
+        this->set_zero_negative(counter - loop.compare_value);
+    }
+    else {
+        this->set_zero_negative(counter);
+    }
+    this->iterations += static_cast<uint64_t>(done) * loop.length;
 }
+
+/* Static recompilation */
+
+//FNV-1a over whatever PRG-ROM is currently mapped in.
+uint64_t Cpu::hash_prgrom() {
+    uint64_t hash = 0xcbf29ce484222325;
+    for(int address = Bus::ROM_START; address <= Bus::ROM_END; address++) {
+        hash ^= this->bus->read_ram(address);
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+//The opcode is a constant here, so the handler call is direct and can be inlined into the generated block.
+template<uint8_t code>
+inline void Cpu::recompiled_step(uint16_t operand) {
+    constexpr Instruction instruction = INSTRUCTIONS[code];
+    this->opcode = code;
+    this->operand = operand;
+    this->trace_instruction();
+    this->execute_instruction(instruction);
+}
+
+#ifdef CPU_RECOMPILED_ROM
+
+//Generated by nesxx-recompile, defines RECOMPILED_PRGROM_HASH and run_recompiled_block.
+#include CPU_RECOMPILED_ROM
+
+bool Cpu::run_recompiled(uint64_t target) {
+    if(!this->recompiled_rom_matches || this->interrupt_pending()) {
+        return false;
+    }
+    return this->run_recompiled_block(target);
+}
+
+#endif
+
+#define CPU_OPCODE_ROW(X, h) X(h##0) X(h##1) X(h##2) X(h##3) X(h##4) X(h##5) X(h##6) X(h##7) \
+                             X(h##8) X(h##9) X(h##a) X(h##b) X(h##c) X(h##d) X(h##e) X(h##f)
+#define CPU_FOR_EACH_OPCODE(X) CPU_OPCODE_ROW(X, 0) CPU_OPCODE_ROW(X, 1) CPU_OPCODE_ROW(X, 2) CPU_OPCODE_ROW(X, 3) \
+                               CPU_OPCODE_ROW(X, 4) CPU_OPCODE_ROW(X, 5) CPU_OPCODE_ROW(X, 6) CPU_OPCODE_ROW(X, 7) \
+                               CPU_OPCODE_ROW(X, 8) CPU_OPCODE_ROW(X, 9) CPU_OPCODE_ROW(X, a) CPU_OPCODE_ROW(X, b) \
+                               CPU_OPCODE_ROW(X, c) CPU_OPCODE_ROW(X, d) CPU_OPCODE_ROW(X, e) CPU_OPCODE_ROW(X, f)
+
+void Cpu::run_for(int cycles) {
+    this->run_until(this->cycles + cycles);
+}
+
+//Runs whole instructions until the cycle count reaches target, the last one may run over.
+void Cpu::run_until(uint64_t target) {
+    this->run_target = target;
+    //The PPU may have changed between runs, so a loop has to be seen making a full pass within this run to be skipped.
+    this->idle_loop_branch = 0;
+    //Recompiled code and translated blocks have to be looked for before every instruction, which the threaded
+    //dispatch can't do, so either of them falls back to the plain loop instead.
+    #if defined(CPU_RECOMPILED_ROM) || defined(CPU_BLOCK_TRANSLATION)
+    while(this->cycles < target) {
+        #ifdef CPU_RECOMPILED_ROM
+        if(this->run_recompiled(target)) {
+            continue;
+        }
+        #endif
+        #ifdef CPU_BLOCK_TRANSLATION
+        if(this->run_translated_block(target)) {
+            continue;
+        }
+        #endif
+        this->fetch_instruction();
+        this->execute_instruction(INSTRUCTIONS[this->opcode]);
+        this->finish_instruction();
+    }
+    #elif defined(CPU_THREADED_DISPATCH)
+    /* Every opcode gets its own label and its own copy of the dispatch jump, so the branch predictor can learn which
+     * opcode tends to follow which instead of sharing a single indirect jump. The table index is a constant at each
+     * label so the handler call is direct. */
+    #define CPU_OPCODE_LABEL(n) &&opcode_##n,
+    #define CPU_OPCODE_BODY(n) \
+        opcode_##n: \
+            this->execute_instruction(INSTRUCTIONS[0x##n]); \
+            this->finish_instruction(); \
+            CPU_DISPATCH();
+    #define CPU_DISPATCH() \
+        if(this->cycles >= target) { \
+            return; \
+        } \
+        this->fetch_instruction(); \
+        goto *dispatch_table[this->opcode];
+    static const void *dispatch_table[256] = {CPU_FOR_EACH_OPCODE(CPU_OPCODE_LABEL)};
+    CPU_DISPATCH();
+    CPU_FOR_EACH_OPCODE(CPU_OPCODE_BODY)
+    #undef CPU_DISPATCH
+    #undef CPU_OPCODE_BODY
+    #undef CPU_OPCODE_LABEL
+    #else
+    while(this->cycles < target) {
+        this->fetch_instruction();
+        this->execute_instruction(INSTRUCTIONS[this->opcode]);
+        this->finish_instruction();
+    }
+    #endif
+}
+
 #ifdef UNITTEST
 
 #endif
\ No newline at end of file
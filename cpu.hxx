@@ -1,16 +1,39 @@
 #ifndef CPU_H
 #define CPU_H
 #include <cstdint>
+#include <array>
+#include <vector>
+#include <unordered_map>
 #include "config.hxx"
 
 //Forward declaration
 class Bus;
+class InterruptLines;
 
 class Cpu {
+    friend class Recompiler;
 private:
     static const uint16_t STACK_OFFSET = 0x100;
     static const uint16_t RESET_INTERRUPT_VECTOR = 0xfffc;
     static const uint16_t NMI_INTERRUPT_VECTOR = 0xfffa;
+    static const uint16_t IRQ_INTERRUPT_VECTOR = 0xfffe;
+    static const int OAM_DMA_CYCLES = 513;
+    /* Everything an instruction touches is declared first and kept within the first cache line of the Cpu, the tables
+     * and caches come after it. */
+    alignas(64) uint64_t cycles;
+    //The cycle count the current run stops at.
+    uint64_t run_target;
+    uint64_t iterations;
+    Bus *bus;
+    InterruptLines *interrupts;
+    uint16_t program_counter, operand;
+    uint8_t x, y, p, stack_pointer, accumulator, opcode;
+    //p only holds the interrupt, decimal and break bits, see get_status for the rest.
+    static const uint8_t LAZY_FLAGS = 0b11000011;
+    uint8_t zero_result, negative_result;
+    bool carry, overflow;
+    //The last backward branch taken, for idle loop skipping.
+    uint16_t idle_loop_branch;
     enum class ProcessorFlag {
         carry     = 0b1,
         zero      = 0b10,
@@ -33,82 +56,212 @@ private:
         indirect_hardware_bug,
         indexed_indirect,
         indirect_indexed,
+        relative,
         none
     };
-    Bus *bus;
-    uint16_t program_counter;
-    uint8_t x, y, p, stack_pointer, accumulator, opcode;
-    uint64_t cycles, iterations;
-    AddressingMode addressing_mode;
-    bool is_processing_interrupt, page_crossed;
+    /* Everything the interpreter needs to know about an opcode. The handler is already specialized for the addressing
+     * mode, so it also charges any page cross penalty itself. Opcodes that set the program counter themselves (jumps,
+     * calls and returns) have sets_program_counter set so the length isn't added on top. */
+    struct Instruction {
+        void (Cpu::*handler)();
+        AddressingMode addressing_mode;
+        uint8_t length;
+        uint8_t cycles;
+        bool sets_program_counter;
+        bool writes_memory;
+    };
+    static const std::array<Instruction, 256> INSTRUCTIONS;
+    static constexpr std::array<Instruction, 256> build_instruction_table();
+    /* PRG-ROM doesn't change unless a mapper switches banks, so instructions fetched from $8000-$ffff are decoded
+     * once and then executed straight out of this cache without going back to the bus. */
+    static const int DECODED_ROM_SIZE = 0x8000;
+    /* What the loop closed by a backward branch in PRG-ROM looks like, worked out the first time it's taken and kept
+     * with the decoded branch. */
+    enum class LoopKind : uint8_t {
+        unknown,
+        other,
+        idle,
+        fill,
+        upload
+    };
+    struct DecodedInstruction {
+        uint16_t operand;
+        uint8_t opcode;
+        bool decoded;
+        LoopKind loop_kind;
+        uint8_t loop_length;
+    };
+    std::array<DecodedInstruction, DECODED_ROM_SIZE> decoded_rom;
+    static const int MAX_LOOP_LENGTH = 8;
+    static const uint8_t OPCODE_BNE = 0xd0;
+    static const uint8_t OPCODE_INX = 0xe8;
+    static const uint8_t OPCODE_DEX = 0xca;
+    static const uint8_t OPCODE_INY = 0xc8;
+    static const uint8_t OPCODE_DEY = 0x88;
+    static const uint8_t OPCODE_CPX_IMMEDIATE = 0xe0;
+    static const uint8_t OPCODE_CPY_IMMEDIATE = 0xc0;
+    static const uint8_t OPCODE_STA_ABSOLUTE = 0x8d;
+    static const uint8_t OPCODE_STA_ZERO_PAGE_X = 0x95;
+    static const uint8_t OPCODE_STA_ABSOLUTE_X = 0x9d;
+    static const uint8_t OPCODE_STA_ABSOLUTE_Y = 0x99;
+    static const uint8_t OPCODE_LDA_ZERO_PAGE_X = 0xb5;
+    static const uint8_t OPCODE_LDA_ABSOLUTE_X = 0xbd;
+    static const uint8_t OPCODE_LDA_ABSOLUTE_Y = 0xb9;
+    static const uint8_t OPCODE_LDA_INDIRECT_INDEXED = 0xb1;
+    /* A loop body taken apart: the counter register and how it steps, what it's compared against to leave the loop, and
+     * the instructions before the step. */
+    struct LoopIdiom {
+        LoopKind kind;
+        uint8_t length;
+        bool counter_y;
+        int8_t step;
+        bool compare;
+        uint8_t compare_value;
+        int data_length;
+        std::array<DecodedInstruction, MAX_LOOP_LENGTH> data;
+    };
+    /* Straight line runs of PRG-ROM instructions translated into a list of handlers with their operands already
+     * fetched. A block ends at anything that changes the program counter, or at the edge of a PRG bank window. The
+     * first instruction that might touch the PPU, controller or mapper registers is its last step, and its side
+     * effects are handled once the block returns. Blocks are keyed by address and PRG bank so switching a bank back
+     * in finds its old blocks again. */
+    static const int MAX_BLOCK_LENGTH = 32;
+    static const int BLOCK_LOOKUP_SIZE = 4096;
+    static const int PRGROM_WINDOW_SIZE = 0x2000;
+    struct TranslatedStep {
+        const Instruction *instruction;
+        uint16_t operand;
+        uint8_t opcode;
+    };
+    struct TranslatedBlock {
+        uint16_t address;
+        int bank;
+        int cycle_budget;
+        std::vector<TranslatedStep> steps;
+    };
+    std::unordered_map<uint32_t, TranslatedBlock> translated_blocks;
+    std::array<TranslatedBlock*, BLOCK_LOOKUP_SIZE> block_lookup;
+    //The PRG-ROM bank each window showed when decoded_rom was last checked against it.
+    std::array<int, 4> decoded_banks;
+    /* Blocks compiled ahead of time by nesxx-recompile. The generated code only matches the PRG-ROM it was made from,
+     * so it's switched off when the hash of the loaded PRG-ROM differs. */
+    static const uint64_t RECOMPILED_PRGROM_HASH;
+    bool recompiled_rom_matches;
+    uint64_t idle_loop_cycles, idle_loop_iterations;
     void set_processor_flag(ProcessorFlag, bool);
     bool check_if_page_crossed(uint16_t, uint16_t);
     bool read_processor_flag(ProcessorFlag);
-    uint16_t address_immediate();
+    void set_zero_negative(uint8_t);
+    uint8_t get_status();
+    void set_status(uint8_t);
     uint16_t address_zero_page();
     uint16_t address_zero_page_x();
     uint16_t address_zero_page_y();
     uint16_t address_absolute();
-    uint16_t address_absolute_x();
-    uint16_t address_absolute_y();
     uint16_t address_indirect();
     uint16_t address_indirect_hardware_bug();
     uint16_t address_indexed_indirect();
-    uint16_t address_indirect_indexed();
-    uint16_t resolve_address();
+    uint16_t address_zero_page_pointer();
+    template<bool page_cross_penalty> uint16_t index_address(uint16_t, uint8_t);
+    template<AddressingMode mode, bool page_cross_penalty = false> uint16_t resolve_address();
+    template<AddressingMode mode> uint8_t read_operand();
     int8_t relative_offset();
-    bool branch(bool);
+    void branch(bool);
     void push(uint8_t);
     void push_16(uint16_t);
     uint8_t pop();
     uint16_t pop_16();
     void nmi_interrupt();
-    void ADC(bool = false);
-    void AND();
-    void ASL();
-    void BIT();
+    void irq_interrupt();
+    uint16_t fetch_operand(uint16_t, uint8_t);
+    const DecodedInstruction &decode_rom_instruction(uint16_t);
+    void trace_instruction();
+    void fetch_instruction();
+    void execute_instruction(const Instruction&);
+    void finish_instruction();
+    bool interrupt_pending();
+    void service_interrupts();
+    void stall_for_oam_dma();
+    void handle_bus_events();
+    bool may_access_io(const Instruction&, uint16_t);
+    TranslatedBlock translate_block(uint16_t, int);
+    TranslatedBlock &find_block(uint16_t);
+    bool run_translated_block(uint64_t);
+    bool is_idle_read(uint8_t, uint16_t);
+    LoopIdiom match_loop(uint16_t, uint16_t);
+    void take_backward_branch(uint16_t);
+    void skip_idle_loop(uint8_t);
+    void run_loop_idiom(const LoopIdiom&);
+    uint64_t hash_prgrom();
+    template<uint8_t code> void recompiled_step(uint16_t);
+    bool run_recompiled_block(uint64_t);
+    bool run_recompiled(uint64_t);
+    void add_with_carry(uint8_t);
+    template<AddressingMode mode> void ADC();
+    template<AddressingMode mode> void AND();
+    template<AddressingMode mode> void ASL();
+    void BCC();
+    void BCS();
+    void BEQ();
+    template<AddressingMode mode> void BIT();
+    void BMI();
+    void BNE();
+    void BPL();
     void BRK();
-    void CMP();
-    void CPX();
-    void CPY();
-    void DEC();
+    void BVC();
+    void BVS();
+    void CLC();
+    void CLD();
+    void CLI();
+    void CLV();
+    template<AddressingMode mode> void CMP();
+    template<AddressingMode mode> void CPX();
+    template<AddressingMode mode> void CPY();
+    template<AddressingMode mode> void DEC();
     void DEX();
     void DEY();
-    void EOR();
-    void INC();
+    template<AddressingMode mode> void EOR();
+    template<AddressingMode mode> void INC();
     void INX();
     void INY();
-    void JMP();
-    void JSR();
-    void LDA();
-    void LDX();
-    void LDY();
-    void LSR();
-    void ORA();
+    template<AddressingMode mode> void JMP();
+    template<AddressingMode mode> void JSR();
+    template<AddressingMode mode> void LDA();
+    template<AddressingMode mode> void LDX();
+    template<AddressingMode mode> void LDY();
+    template<AddressingMode mode> void LSR();
+    void NOP();
+    template<AddressingMode mode> void ORA();
     void PHA();
     void PHP();
     void PLA();
     void PLP();
-    void ROL();
-    void ROR();
+    template<AddressingMode mode> void ROL();
+    template<AddressingMode mode> void ROR();
     void RTI();
     void RTS();
-    void SBC();
-    void STA();
-    void STX();
-    void STY();
+    template<AddressingMode mode> void SBC();
+    void SEC();
+    void SED();
+    void SEI();
+    template<AddressingMode mode> void STA();
+    template<AddressingMode mode> void STX();
+    template<AddressingMode mode> void STY();
     void TAX();
     void TAY();
     void TSX();
     void TXA();
     void TXS();
     void TYA();
+    void illegal_opcode();
 public:
     Cpu();
     void connect_bus(Bus *bus);
     void prepare_for_nestest();
+    void invalidate_decoded_rom(uint16_t start = 0x8000, uint16_t end = 0xffff);
     void run_for(int);
-    int run_instruction();
+    void run_until(uint64_t);
+    uint64_t get_cycles() {return this->cycles;};
     void reset();
 };
 
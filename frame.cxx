@@ -1,13 +1,19 @@
 #include "frame.hxx"
+#include "access.hxx"
 
 void Frame::set_pixel(int x, int y, uint32_t color) {
     int i = x + (y * this->WIDTH);
-    this->buffer.at(i) = color;
+    memory_at(this->buffer, i, "frame") = color;
 }
 
 uint32_t Frame::get_pixel(int x, int y) {
     int i = x + (y * this->WIDTH);
-    return this->buffer.at(i);
+    return memory_at(this->buffer, i, "frame");
+}
+
+//The ppu draws a whole scanline through one pointer, only the row itself is checked.
+uint32_t *Frame::get_row(int y) {
+    return &memory_at(this->buffer, y * this->WIDTH, "frame");
 }
 
 void Frame::clear(uint32_t color) {
@@ -10,6 +10,7 @@ public:
     std::array<uint32_t, WIDTH * HEIGHT> buffer;
     void set_pixel(int, int, uint32_t);
     uint32_t get_pixel(int, int);
+    uint32_t *get_row(int);
     void clear(uint32_t color = 0x00000000);
     int get_pitch();
 };
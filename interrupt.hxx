@@ -0,0 +1,33 @@
+#ifndef INTERRUPT_H
+#define INTERRUPT_H
+#include <cstdint>
+#include <array>
+
+/* The NMI and IRQ inputs of the cpu. Components assert a line, optionally not taking effect before a given cpu cycle,
+ * and the cpu only has to test the pending word between instructions. NMI is edge triggered, so it stays latched until
+ * the cpu services it. IRQ is level triggered, so it stays asserted until whoever raised it releases it. */
+
+class InterruptLines {
+public:
+    enum class Line : uint8_t {
+        nmi = 0b1,
+        irq = 0b10
+    };
+private:
+    uint8_t pending;
+    std::array<uint64_t, 2> asserted_at;
+    static int index(Line line) {return static_cast<int>(line) >> 1;};
+public:
+    InterruptLines() : pending(0), asserted_at{0, 0} {};
+    void assert_line(Line line, uint64_t cycle = 0) {
+        this->pending |= static_cast<uint8_t>(line);
+        this->asserted_at[index(line)] = cycle;
+    };
+    void release_line(Line line) {this->pending &= ~static_cast<uint8_t>(line);};
+    bool any_pending() {return this->pending != 0;};
+    bool is_pending(Line line) {return this->pending & static_cast<uint8_t>(line);};
+    bool is_due(Line line, uint64_t cycle) {return this->is_pending(line) && cycle >= this->asserted_at[index(line)];};
+    void clear() {this->pending = 0;};
+};
+
+#endif
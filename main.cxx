@@ -46,33 +46,13 @@ int main() {
 #ifndef NESTEST
 
 #include <iostream>
-#include "cpu.hxx"
-#include "bus.hxx"
-#include "ppu.hxx"
-#include "rom.hxx"
-#include "frame.hxx"
-#include "controller.hxx"
+#include "system.hxx"
 
 int main(int argc, char **argv) {
-    Cpu cpu;
-    Ppu ppu;
-    Bus bus;
-    Rom rom;
-    Frame frame;
-    Controller controller;
-    rom.load_from_file(argv[1]);
-    cpu.connect_bus(&bus);
-    bus.connect_ppu(&ppu);
-    bus.connect_rom(&rom);
-    bus.connect_controller(&controller);
-    ppu.connect_bus(&bus);
-    ppu.connect_frame(&frame);
-    cpu.reset();
-    ppu.reset();
-    frame.clear();
+    System system(argv[1]);
+    system.reset();
     while(true) {
-        cpu.run_for(1);
-        ppu.render_scanline();
+        system.run_frame();
         std::cin.ignore();
     }
     return 0;
@@ -89,36 +69,19 @@ int main(int argc, char **argv) {
 
 #include <iostream>
 #include <SDL2/SDL.h>
-#include "cpu.hxx"
-#include "bus.hxx"
-#include "ppu.hxx"
-#include "rom.hxx"
-#include "frame.hxx"
-#include "controller.hxx"
+#include "system.hxx"
 #include "framerate.hxx"
 
 const int DISPLAY_WIDTH = Frame::WIDTH * 3;
 const int DISPLAY_HEIGHT = Frame::HEIGHT * 3;
 
 int main(int argc, char **argv) {
-    Cpu cpu;
-    Ppu ppu;
-    Bus bus;
-    Rom rom;
-    Frame frame;
-    Controller controller;
+    System system(argv[1]);
+    Frame &frame = system.frame;
+    Controller &controller = system.controller;
     FrameRate framerate;
     framerate.set_target_framerate(60);
-    rom.load_from_file(argv[1]);
-    cpu.connect_bus(&bus);
-    bus.connect_ppu(&ppu);
-    bus.connect_rom(&rom);
-    bus.connect_controller(&controller);
-    ppu.connect_bus(&bus);
-    ppu.connect_frame(&frame);
-    cpu.reset();
-    ppu.reset();
-    frame.clear();
+    system.reset();
     if (SDL_Init(SDL_INIT_VIDEO) != 0) {
         std::cout << "Failed to init SDL" << SDL_GetError() << std::endl;
         return 1;
@@ -162,17 +125,14 @@ int main(int argc, char **argv) {
                     if(!keys[SDL_SCANCODE_DOWN]) controller.set_button(Controller::Button::b, false);
             }
         }
-        cpu.run_for(100);
-        ppu.render_scanline();
-        if (ppu.get_scanline() == 240) {
-            SDL_UpdateTexture(frame_buffer, NULL, frame.buffer.data(), frame.get_pitch());
-            SDL_RenderCopy(renderer, frame_buffer, NULL, NULL);
-            SDL_RenderPresent(renderer);
-            framerate.sleep();
-            std::cout << std::string("\rFrametime: " + std::to_string(framerate.get_frametime()));
-            std::cout.flush();
-            framerate.tick();
-        }
+        system.run_frame();
+        SDL_UpdateTexture(frame_buffer, NULL, frame.buffer.data(), frame.get_pitch());
+        SDL_RenderCopy(renderer, frame_buffer, NULL, NULL);
+        SDL_RenderPresent(renderer);
+        framerate.sleep();
+        std::cout << std::string("\rFrametime: " + std::to_string(framerate.get_frametime()));
+        std::cout.flush();
+        framerate.tick();
     }
     quit:
     SDL_Quit();
@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include "mapper.hxx"
+
+Mapper::Mapper(Rom &rom) : rom(rom) {}
+
+std::unique_ptr<Mapper> Mapper::create(int number, Rom &rom) {
+    switch(number) {
+        case NROM:
+            return std::make_unique<NromMapper>(rom);
+        case MMC1:
+            return std::make_unique<Mmc1Mapper>(rom);
+        case UXROM:
+            return std::make_unique<UxromMapper>(rom);
+        case CNROM:
+            return std::make_unique<CnromMapper>(rom);
+        case MMC3:
+            return std::make_unique<Mmc3Mapper>(rom);
+        case AXROM:
+            return std::make_unique<AxromMapper>(rom);
+        default:
+            throw std::runtime_error("Mapper " + std::to_string(number) + " is not supported");
+    }
+}
+
+//Points count 8KB windows starting at window at a bank that is count windows in size.
+uint8_t Mapper::select_prgrom(int window, int count, int bank) {
+    int windows_in_rom = this->rom.prgrom.size / Rom::PRGROM_BANK_SIZE;
+    int banks_in_rom = std::max(1, windows_in_rom / count);
+    bank = (bank % banks_in_rom + banks_in_rom) % banks_in_rom;
+    uint8_t changes = 0;
+    for(int x = 0; x < count; x++) {
+        int rom_bank = (bank * count + x) % windows_in_rom;
+        uint8_t *data = this->rom.prgrom.data + rom_bank * Rom::PRGROM_BANK_SIZE;
+        if(this->rom.prgrom_windows[window + x] != data) {
+            this->rom.prgrom_windows[window + x] = data;
+            this->rom.prgrom_banks[window + x] = rom_bank;
+            changes = prgrom_changed;
+        }
+    }
+    return changes;
+}
+
+//Points count 1KB windows starting at window at a bank that is count windows in size.
+uint8_t Mapper::select_chrrom(int window, int count, int bank) {
+    int windows_in_rom = this->rom.chrrom.size / Rom::CHRROM_BANK_SIZE;
+    int banks_in_rom = std::max(1, windows_in_rom / count);
+    bank = (bank % banks_in_rom + banks_in_rom) % banks_in_rom;
+    uint8_t changes = 0;
+    for(int x = 0; x < count; x++) {
+        int rom_bank = (bank * count + x) % windows_in_rom;
+        uint8_t *data = this->rom.chrrom.data + rom_bank * Rom::CHRROM_BANK_SIZE;
+        if(this->rom.chrrom_windows[window + x] != data) {
+            this->rom.chrrom_windows[window + x] = data;
+            this->rom.decoded_chr_windows[window + x] =
+                this->rom.decoded_chr.data() + rom_bank * (Rom::CHRROM_BANK_SIZE / Rom::CHR_TILE_SIZE);
+            changes = chrrom_changed;
+        }
+    }
+    return changes;
+}
+
+uint8_t Mapper::set_mirroring(Rom::MirroringType mirroring_type) {
+    if(this->rom.mirroring_type == mirroring_type) {
+        return 0;
+    }
+    this->rom.mirroring_type = mirroring_type;
+    return mirroring_changed;
+}
+
+/* NROM */
+
+void NromMapper::reset() {
+    this->select_prgrom(0, 4, 0);
+    this->select_chrrom(0, 8, 0);
+}
+
+/* MMC1, registers are loaded a bit at a time through a 5 bit shift register. */
+
+void Mmc1Mapper::reset() {
+    this->shift = 0;
+    this->shift_count = 0;
+    this->control = 0x0c;
+    this->chrrom_bank_0 = 0;
+    this->chrrom_bank_1 = 0;
+    this->prgrom_bank = 0;
+    this->update_banks();
+}
+
+//Only the fifth write of a register loads it, the ones before it just shift a bit in and change nothing.
+uint8_t Mmc1Mapper::write_register(uint16_t address, uint8_t value) {
+    if(value & 0x80) {
+        this->shift = 0;
+        this->shift_count = 0;
+        this->control |= 0x0c;
+        return this->update_banks();
+    }
+    this->shift |= (value & 1) << this->shift_count;
+    this->shift_count++;
+    if(this->shift_count < 5) {
+        return 0;
+    }
+    switch((address >> 13) & 0b11) {
+        case 0:
+            this->control = this->shift;
+            break;
+        case 1:
+            this->chrrom_bank_0 = this->shift;
+            break;
+        case 2:
+            this->chrrom_bank_1 = this->shift;
+            break;
+        case 3:
+            this->prgrom_bank = this->shift & 0x0f;
+            break;
+    }
+    this->shift = 0;
+    this->shift_count = 0;
+    return this->update_banks();
+}
+
+uint8_t Mmc1Mapper::update_banks() {
+    uint8_t changes = 0;
+    switch(this->control & 0b11) {
+        case 0:
+            changes |= this->set_mirroring(Rom::MirroringType::single_screen_lower);
+            break;
+        case 1:
+            changes |= this->set_mirroring(Rom::MirroringType::single_screen_upper);
+            break;
+        case 2:
+            changes |= this->set_mirroring(Rom::MirroringType::vertical);
+            break;
+        case 3:
+            changes |= this->set_mirroring(Rom::MirroringType::horizontal);
+            break;
+    }
+    switch((this->control >> 2) & 0b11) {
+        case 0:
+        case 1:
+            changes |= this->select_prgrom(0, 4, this->prgrom_bank >> 1);
+            break;
+        case 2:
+            changes |= this->select_prgrom(0, 2, 0);
+            changes |= this->select_prgrom(2, 2, this->prgrom_bank);
+            break;
+        case 3:
+            changes |= this->select_prgrom(0, 2, this->prgrom_bank);
+            changes |= this->select_prgrom(2, 2, -1);
+            break;
+    }
+    if(this->control & 0x10) {
+        changes |= this->select_chrrom(0, 4, this->chrrom_bank_0);
+        changes |= this->select_chrrom(4, 4, this->chrrom_bank_1);
+    }
+    else {
+        changes |= this->select_chrrom(0, 8, this->chrrom_bank_0 >> 1);
+    }
+    return changes;
+}
+
+/* UxROM, a switchable 16KB bank at $8000 and the last one fixed at $c000. */
+
+void UxromMapper::reset() {
+    this->select_prgrom(0, 2, 0);
+    this->select_prgrom(2, 2, -1);
+    this->select_chrrom(0, 8, 0);
+}
+
+uint8_t UxromMapper::write_register(uint16_t, uint8_t value) {
+    return this->select_prgrom(0, 2, value);
+}
+
+/* CNROM, fixed PRG-ROM and a switchable 8KB of CHR-ROM. */
+
+void CnromMapper::reset() {
+    this->select_prgrom(0, 4, 0);
+    this->select_chrrom(0, 8, 0);
+}
+
+uint8_t CnromMapper::write_register(uint16_t, uint8_t value) {
+    return this->select_chrrom(0, 8, value);
+}
+
+/* MMC3, eight bank registers selected through $8000 and written through $8001. */
+
+void Mmc3Mapper::reset() {
+    this->bank_select = 0;
+    this->bank_registers = {0, 2, 4, 5, 6, 7, 0, 1};
+    this->irq_latch = 0;
+    this->irq_counter = 0;
+    this->irq_reload = false;
+    this->irq_enabled = false;
+    this->update_banks();
+}
+
+uint8_t Mmc3Mapper::write_register(uint16_t address, uint8_t value) {
+    switch(address & 0xe001) {
+        case 0x8000:
+            this->bank_select = value;
+            return this->update_banks();
+        case 0x8001:
+            this->bank_registers[this->bank_select & 0b111] = value;
+            return this->update_banks();
+        case 0xa000:
+            if(this->rom.get_mirroring_type() != Rom::MirroringType::four_screen) {
+                return this->set_mirroring(value & 1 ? Rom::MirroringType::horizontal : Rom::MirroringType::vertical);
+            }
+            break;
+        //$a001 only protects PRG-RAM, which is always writable here.
+        case 0xc000:
+            this->irq_latch = value;
+            break;
+        case 0xc001:
+            this->irq_counter = 0;
+            this->irq_reload = true;
+            break;
+        case 0xe000:
+            this->irq_enabled = false;
+            break;
+        case 0xe001:
+            this->irq_enabled = true;
+            break;
+    }
+    return 0;
+}
+
+/* An empty counter, or one that was told to reload, is loaded from the latch on the next clock and otherwise counts
+ * down. Reaching zero raises the IRQ, even straight after a reload with a latch of 0, which is how the later MMC3
+ * revisions behave. */
+int64_t Mmc3Mapper::get_clocks_until_zero() {
+    return this->irq_counter == 0 || this->irq_reload ? this->irq_latch + 1 : this->irq_counter;
+}
+
+//Runs the counter forward by any number of clocks at once, it repeats every latch + 1 clocks after the first reload.
+bool Mmc3Mapper::clock_scanline_counter(uint64_t clocks) {
+    bool reached_zero = static_cast<int64_t>(clocks) >= this->get_clocks_until_zero();
+    if(this->irq_counter == 0 || this->irq_reload) {
+        this->irq_counter = this->irq_latch;
+        this->irq_reload = false;
+    }
+    else {
+        this->irq_counter--;
+    }
+    clocks--;
+    if(clocks <= this->irq_counter) {
+        this->irq_counter -= clocks;
+    }
+    else {
+        clocks -= this->irq_counter + 1;
+        this->irq_counter = this->irq_latch - clocks % (this->irq_latch + 1);
+    }
+    return reached_zero && this->irq_enabled;
+}
+
+int64_t Mmc3Mapper::get_clocks_until_irq() {
+    return this->irq_enabled ? this->get_clocks_until_zero() : -1;
+}
+
+uint8_t Mmc3Mapper::update_banks() {
+    uint8_t changes = 0;
+    if(this->bank_select & 0x40) {
+        changes |= this->select_prgrom(0, 1, -2);
+        changes |= this->select_prgrom(2, 1, this->bank_registers[6]);
+    }
+    else {
+        changes |= this->select_prgrom(0, 1, this->bank_registers[6]);
+        changes |= this->select_prgrom(2, 1, -2);
+    }
+    changes |= this->select_prgrom(1, 1, this->bank_registers[7]);
+    changes |= this->select_prgrom(3, 1, -1);
+    //The 2KB banks are at $0000 and the 1KB banks at $1000, or the other way around with CHR A12 inverted.
+    int large_banks = this->bank_select & 0x80 ? 4 : 0;
+    int small_banks = large_banks ^ 4;
+    changes |= this->select_chrrom(large_banks, 2, this->bank_registers[0] >> 1);
+    changes |= this->select_chrrom(large_banks + 2, 2, this->bank_registers[1] >> 1);
+    for(int x = 0; x < 4; x++) {
+        changes |= this->select_chrrom(small_banks + x, 1, this->bank_registers[2 + x]);
+    }
+    return changes;
+}
+
+/* AxROM, 32KB PRG-ROM banks and single screen mirroring picked by the same register. */
+
+void AxromMapper::reset() {
+    this->select_prgrom(0, 4, 0);
+    this->select_chrrom(0, 8, 0);
+    this->set_mirroring(Rom::MirroringType::single_screen_lower);
+}
+
+uint8_t AxromMapper::write_register(uint16_t, uint8_t value) {
+    uint8_t changes = this->select_prgrom(0, 4, value & 0b111);
+    changes |= this->set_mirroring(value & 0x10 ? Rom::MirroringType::single_screen_upper :
+                                                  Rom::MirroringType::single_screen_lower);
+    return changes;
+}
@@ -0,0 +1,100 @@
+#ifndef MAPPER_HXX
+#define MAPPER_HXX
+#include <cstdint>
+#include <memory>
+#include "rom.hxx"
+
+/* A mapper only decides which banks the rom's windows show. Register writes point the 8KB PRG and 1KB CHR windows at
+ * other banks and never copy anything, reads go straight through the window pointers. Bank numbers are wrapped to
+ * the size of the rom, and negative ones count from the end, so -1 is always the last bank. */
+
+class Mapper {
+protected:
+    Rom &rom;
+    uint8_t select_prgrom(int, int, int);
+    uint8_t select_chrrom(int, int, int);
+    uint8_t set_mirroring(Rom::MirroringType);
+public:
+    //What a register write changed, so only that has to be looked at again. Writes that change nothing return 0.
+    enum Change : uint8_t {
+        prgrom_changed    = 0b1,
+        chrrom_changed    = 0b10,
+        mirroring_changed = 0b100
+    };
+    static const int NROM  = 0;
+    static const int MMC1  = 1;
+    static const int UXROM = 2;
+    static const int CNROM = 3;
+    static const int MMC3  = 4;
+    static const int AXROM = 7;
+    explicit Mapper(Rom&);
+    virtual ~Mapper() = default;
+    static std::unique_ptr<Mapper> create(int, Rom&);
+    virtual void reset() = 0;
+    virtual uint8_t write_register(uint16_t, uint8_t) {return 0;};
+    /* Mappers with a scanline counter are never clocked one scanline at a time. The scheduler catches the counter up
+     * by however many clocks the ppu gave it since it last looked, and asks how many more it takes to raise an IRQ,
+     * or -1 if it won't raise one. */
+    virtual bool counts_scanlines() {return false;};
+    virtual bool clock_scanline_counter(uint64_t) {return false;};
+    virtual int64_t get_clocks_until_irq() {return -1;};
+    virtual bool is_irq_enabled() {return false;};
+};
+
+class NromMapper : public Mapper {
+public:
+    using Mapper::Mapper;
+    void reset() override;
+};
+
+class Mmc1Mapper : public Mapper {
+private:
+    uint8_t shift, shift_count;
+    uint8_t control, chrrom_bank_0, chrrom_bank_1, prgrom_bank;
+    uint8_t update_banks();
+public:
+    using Mapper::Mapper;
+    void reset() override;
+    uint8_t write_register(uint16_t, uint8_t) override;
+};
+
+class UxromMapper : public Mapper {
+public:
+    using Mapper::Mapper;
+    void reset() override;
+    uint8_t write_register(uint16_t, uint8_t) override;
+};
+
+class CnromMapper : public Mapper {
+public:
+    using Mapper::Mapper;
+    void reset() override;
+    uint8_t write_register(uint16_t, uint8_t) override;
+};
+
+class Mmc3Mapper : public Mapper {
+private:
+    uint8_t bank_select;
+    std::array<uint8_t, 8> bank_registers;
+    uint8_t irq_latch, irq_counter;
+    bool irq_reload, irq_enabled;
+    uint8_t update_banks();
+    int64_t get_clocks_until_zero();
+public:
+    using Mapper::Mapper;
+    void reset() override;
+    uint8_t write_register(uint16_t, uint8_t) override;
+    bool counts_scanlines() override {return true;};
+    bool clock_scanline_counter(uint64_t) override;
+    int64_t get_clocks_until_irq() override;
+    bool is_irq_enabled() override {return this->irq_enabled;};
+};
+
+class AxromMapper : public Mapper {
+public:
+    using Mapper::Mapper;
+    void reset() override;
+    uint8_t write_register(uint16_t, uint8_t) override;
+};
+
+#endif //MAPPER_HXX
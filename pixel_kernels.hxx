@@ -0,0 +1,75 @@
+#ifndef PIXEL_KERNELS_HXX
+#define PIXEL_KERNELS_HXX
+#include <cstdint>
+#include <cstring>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+/* The ppu's innermost pixel loops. Which version is compiled in follows the instruction sets the compiler targets,
+ * which the build sets with -march=native: AVX2 and BMI2 where there are, SSE2 on any other x86-64, and plain loops
+ * everywhere else. Pixel indices are one byte each, leftmost pixel first, colours are 0x00RRGGBB. */
+
+//Combines the two bitplanes of a tile row into its 8 pixel indices, and the same row mirrored for flipped sprites.
+inline void expand_bitplanes(uint8_t bitplane_a, uint8_t bitplane_b, uint8_t *row, uint8_t *flipped_row) {
+    #if defined(__BMI2__)
+    //pdep drops bit x of each plane into byte x, which is the row mirrored since the leftmost pixel is bit 7.
+    uint64_t flipped = _pdep_u64(bitplane_a, 0x0101010101010101) | _pdep_u64(bitplane_b, 0x0101010101010101) << 1;
+    uint64_t pixels = __builtin_bswap64(flipped);
+    std::memcpy(row, &pixels, 8);
+    std::memcpy(flipped_row, &flipped, 8);
+    #elif defined(__SSE2__)
+    //Every byte tests one bit of both planes, the leftmost pixel's bit in the first byte.
+    const __m128i bits = _mm_set_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 4, 8, 16, 32, 64, -128);
+    __m128i plane_a = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(bitplane_a), bits), bits);
+    __m128i plane_b = _mm_cmpeq_epi8(_mm_and_si128(_mm_set1_epi8(bitplane_b), bits), bits);
+    __m128i pixels = _mm_or_si128(_mm_and_si128(plane_a, _mm_set1_epi8(1)), _mm_and_si128(plane_b, _mm_set1_epi8(2)));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(row), pixels);
+    for(int x = 0; x < 8; x++) {
+        flipped_row[x] = row[7 - x];
+    }
+    #else
+    for(int x = 0; x < 8; x++) {
+        uint8_t pixel = ((bitplane_b >> (7 - x)) & 0b1) << 1 | ((bitplane_a >> (7 - x)) & 0b1);
+        row[x] = pixel;
+        flipped_row[7 - x] = pixel;
+    }
+    #endif
+}
+
+//Looks 8 pixel indices up in a 4 colour pallete.
+inline void map_tile_row(const uint8_t *indices, const uint32_t *colors, uint32_t *pixels) {
+    #if defined(__AVX2__)
+    //The indices widen to one per 32 bit lane and pick their colours in a single permute.
+    __m256i pallete = _mm256_castsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(colors)));
+    __m256i lanes = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices)));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels), _mm256_permutevar8x32_epi32(pallete, lanes));
+    #elif defined(__SSE2__)
+    //Without a variable shuffle every lane compares its index against all 4 and keeps the colour that matched.
+    __m128i bytes = _mm_unpacklo_epi8(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(indices)), _mm_setzero_si128());
+    __m128i halves[2] = {_mm_unpacklo_epi16(bytes, _mm_setzero_si128()),
+                         _mm_unpackhi_epi16(bytes, _mm_setzero_si128())};
+    for(int half = 0; half < 2; half++) {
+        __m128i mapped = _mm_setzero_si128();
+        for(int index = 0; index < 4; index++) {
+            __m128i match = _mm_cmpeq_epi32(halves[half], _mm_set1_epi32(index));
+            mapped = _mm_or_si128(mapped, _mm_and_si128(match, _mm_set1_epi32(colors[index])));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + half * 4), mapped);
+    }
+    #else
+    for(int x = 0; x < 8; x++) {
+        pixels[x] = colors[indices[x] & 0b11];
+    }
+    #endif
+}
+
+//A whole line of tiles at once, each tile row with its own pallete out of the 4 in colors.
+inline void map_scanline(const uint8_t *indices, const uint8_t *palletes, const uint32_t *colors, uint32_t *pixels,
+                         int tiles) {
+    for(int tile = 0; tile < tiles; tile++) {
+        map_tile_row(indices + tile * 8, colors + palletes[tile] * 4, pixels + tile * 8);
+    }
+}
+
+#endif //PIXEL_KERNELS_HXX
@@ -1,27 +1,15 @@
 #include <cassert>
+#include <algorithm>
 #include "ppu.hxx"
+#include "access.hxx"
 #include "bus.hxx"
 #include "frame.hxx"
+#include "rom.hxx"
+#include "pixel_kernels.hxx"
 #ifdef PPU_DEBUG_OUTPUT
 #include <iostream>
 #endif
 
-TileSlice::TileSlice(uint8_t bitplane_a, uint8_t bitplane_b):bitplane_a(bitplane_a),
-                                                             bitplane_b(bitplane_b) {};
-
-int TileSlice::get_pixel(int x, bool flip) {
-    if(flip) {
-        int pixel_a = ((this->bitplane_a >> x) & 0b1);
-        int pixel_b = ((this->bitplane_b >> x) & 0b1);
-        return ((pixel_b << 1) | pixel_a);
-    }
-    else {
-        int pixel_a = ((this->bitplane_a >> (7 - x)) & 0b1);
-        int pixel_b = ((this->bitplane_b >> (7 - x)) & 0b1);
-        return ((pixel_b << 1) | pixel_a);
-    }
-}
-
 int BackgroundTile::get_tile_index(int x, int y) {
     /*This allows us look up what byte in the nametable we need to fetch for the tile slice at a given position,
      * amount other things. */
@@ -66,18 +54,6 @@ int AttributeTable::get_pallete(int quadrant) {
     }
 }
 
-FramePallete::FramePallete(const std::array<uint8_t, PALLETE_SIZE>& pallete_data):data(pallete_data) {};
-
-int FramePallete::get_backround_color_index(int pallete, int index) {
-    int color_group_offset = 4 * pallete;
-    return this->data.at(color_group_offset + index);
-}
-
-int FramePallete::get_sprite_color_index(int pallete, int index) {
-    int color_group_offset = 16 + (pallete * 4);
-    return this->data.at(color_group_offset + index);
-}
-
 Sprite::Sprite(uint8_t x, uint8_t y, uint8_t pattern_table_index, uint8_t attribute):
               x(x),y(y + 1),pattern_table_index(pattern_table_index),attribute(attribute) {};
 
@@ -125,9 +101,19 @@ Ppu::Ppu() {
     this->status      = 0;
     this->oam_address = 0;
     this->oam.fill(0);
+    this->sprite_bins_stale = true;
+    this->background_indices.fill(0);
     this->scroll  = 0;
     this->address = 0;
     this->pallete_ram.fill(0);
+    this->resolve_pallete();
+    this->data = 0;
+    this->data_buffer = 0;
+    this->address_io_in_progress = false;
+    this->scroll_io_in_progress = false;
+    this->scanline = 0;
+    this->cycles = 0;
+    this->nmi_output = false;
 }
 
 void Ppu::connect_bus(Bus *bus) {
@@ -150,6 +136,7 @@ void Ppu::set_controller_flag(ControllerFlag flag, bool on) {
     else {
         this->controller &= ~static_cast<unsigned int>(flag);
     }
+    this->update_nmi_output();
 }
 
 void Ppu::write_controller(uint8_t value) {
@@ -160,6 +147,7 @@ void Ppu::write_controller(uint8_t value) {
               << std::endl;
     #endif
     this->controller = value;
+    this->update_nmi_output();
 }
 
 bool Ppu::get_controller_flag(ControllerFlag flag) {
@@ -190,7 +178,12 @@ void Ppu::write_mask(uint8_t value) {
               << static_cast<unsigned int>(value)
               << std::endl;
     #endif
+    uint8_t changed = this->mask ^ value;
     this->mask = value;
+    if(changed & (static_cast<uint8_t>(MaskFlag::greyscale) | static_cast<uint8_t>(MaskFlag::emphasize_red) |
+                  static_cast<uint8_t>(MaskFlag::emphasize_green) | static_cast<uint8_t>(MaskFlag::emphasize_blue))) {
+        this->resolve_pallete();
+    }
 }
 
 bool Ppu::get_mask_flag(MaskFlag flag) {
@@ -211,6 +204,7 @@ void Ppu::set_status_flag(StatusFlag flag, bool on) {
     else {
         this->status &= ~static_cast<unsigned int>(flag);
     }
+    this->update_nmi_output();
 }
 
 void Ppu::write_status(uint8_t value) {
@@ -221,6 +215,7 @@ void Ppu::write_status(uint8_t value) {
               << std::endl;
     #endif
     this->status = value;
+    this->update_nmi_output();
 }
 
 bool Ppu::get_status_flag(StatusFlag flag) {
@@ -263,8 +258,9 @@ void Ppu::write_oam(uint8_t value) {
               << static_cast<unsigned int>(value)
               << std::endl;
     #endif
-    this->oam.at(this->oam_address) = value;
+    memory_at(this->oam, this->oam_address, "oam") = value;
     this->oam_address++;
+    this->sprite_bins_stale = true;
 }
 
 uint8_t Ppu::read_oam() {
@@ -276,7 +272,7 @@ uint8_t Ppu::read_oam() {
               << static_cast<unsigned int>(this->oam.at(this->oam_address))
               << std::endl;
     #endif
-    uint8_t value = this->oam.at(this->oam_address);
+    uint8_t value = memory_at(this->oam, this->oam_address, "oam");
     if (!this->get_status_flag(StatusFlag::vblank)) {
         this->oam_address++;
     }
@@ -394,7 +390,15 @@ void Ppu::write_pallete_ram(uint16_t address, uint8_t value) {
               << static_cast<unsigned int>(value)
               << std::endl;
     #endif
-    this->pallete_ram.at(address) = value;
+    address = mirror_pallete_address(address);
+    //Pallete ram is only 6 bits wide.
+    memory_at(this->pallete_ram, address, "pallete ram") = value & 0x3f;
+    if(address == 0) {
+        this->resolve_pallete();
+    }
+    else {
+        this->resolve_pallete_entry(address);
+    }
 }
 
 uint8_t Ppu::read_pallete_ram(uint16_t address) {
@@ -404,18 +408,62 @@ uint8_t Ppu::read_pallete_ram(uint16_t address) {
               << static_cast<unsigned int>(address)
               << std::endl;
     #endif
-    return this->pallete_ram.at(address);
+    return memory_at(this->pallete_ram, mirror_pallete_address(address), "pallete ram");
 }
 
-bool Ppu::poll_nmi_interrupt() {
-    if (this->get_status_flag(StatusFlag::vblank) &&
-        this->get_controller_flag(ControllerFlag::generate_nmi_on_vblank))
-    {
-        return true;
+//The 32 bytes repeat up to $3fff, and colour 0 of each sprite pallete is the same byte as colour 0 of the background one.
+int Ppu::mirror_pallete_address(uint16_t address) {
+    address &= PALLETE_TABLE_SIZE - 1;
+    if((address & 0b10011) == SPRITE_PALLETES_START) {
+        address -= SPRITE_PALLETES_START;
     }
-    else {
-        return false;
+    return address;
+}
+
+void Ppu::resolve_pallete() {
+    for(int entry = 0; entry < PALLETE_TABLE_SIZE; entry++) {
+        this->resolve_pallete_entry(entry);
+    }
+}
+
+/* Greyscale keeps only the grey column of the system pallete. Emphasising a colour darkens the other two, so with all
+ * three set everything is darker. */
+void Ppu::resolve_pallete_entry(int entry) {
+    int system_pallete_index = memory_at(this->pallete_ram, entry % 4 == 0 ? 0 : entry, "pallete ram");
+    if(this->get_mask_flag(MaskFlag::greyscale)) {
+        system_pallete_index &= 0x30;
+    }
+    uint32_t color = memory_at(SYSTEM_PALLETE, system_pallete_index, "system pallete");
+    bool emphasize_red = this->get_mask_flag(MaskFlag::emphasize_red);
+    bool emphasize_green = this->get_mask_flag(MaskFlag::emphasize_green);
+    bool emphasize_blue = this->get_mask_flag(MaskFlag::emphasize_blue);
+    if(emphasize_red || emphasize_green || emphasize_blue) {
+        uint32_t red = color >> 16 & 0xff;
+        uint32_t green = color >> 8 & 0xff;
+        uint32_t blue = color & 0xff;
+        if(emphasize_green || emphasize_blue) {
+            red -= red / 4;
+        }
+        if(emphasize_red || emphasize_blue) {
+            green -= green / 4;
+        }
+        if(emphasize_red || emphasize_green) {
+            blue -= blue / 4;
+        }
+        color = red << 16 | green << 8 | blue;
     }
+    memory_at(this->resolved_pallete, entry, "resolved pallete") = color;
+}
+
+/* The NMI output is low while in vblank with NMI generation enabled, and the cpu only reacts to it going low. That
+ * happens when vblank starts with NMI enabled, or when NMI gets enabled part way through vblank. */
+void Ppu::update_nmi_output() {
+    bool output = this->get_status_flag(StatusFlag::vblank) &&
+                  this->get_controller_flag(ControllerFlag::generate_nmi_on_vblank);
+    if(output && !this->nmi_output) {
+        this->bus->interrupts.assert_line(InterruptLines::Line::nmi);
+    }
+    this->nmi_output = output;
 }
 
 int Ppu::get_nametable() {
@@ -452,11 +500,10 @@ int Ppu::get_pattern_table_index_from_nametable(int tile_index, int nametable) {
     return this->bus->read_vram(nametable_address);
 }
 
-TileSlice Ppu::get_tile_slice(int pattern_table_index, int pattern_table, int slice) {
+//Pattern tables only ever hold CHR, so tile rows come decoded straight from the cartridge instead of through vram.
+const uint8_t *Ppu::get_tile_row(int pattern_table_index, int pattern_table, int slice, bool flip) {
     int pattern_table_address = (Bus::PATTERN_TABLE_SIZE * pattern_table) + (pattern_table_index * 16) + slice;
-    uint8_t bitplane_a = this->bus->read_vram(pattern_table_address);
-    uint8_t bitplane_b = this->bus->read_vram(pattern_table_address + 8);
-    return TileSlice(bitplane_a, bitplane_b);
+    return this->bus->rom->get_tile_row(pattern_table_address, flip);
 }
 
 AttributeTable Ppu::get_attribute_table(int i, int nametable) {
@@ -464,107 +511,144 @@ AttributeTable Ppu::get_attribute_table(int i, int nametable) {
     return AttributeTable(this->bus->read_vram(attribute_table_address));
 }
 
-FramePallete Ppu::get_frame_pallete() {
-    return FramePallete(this->pallete_ram);
-}
-
 Sprite Ppu::get_sprite(int sprite_index) {
     sprite_index *= 4;
-    uint8_t y = this->oam.at(sprite_index);
-    uint8_t pattern_table_index = this->oam.at(sprite_index + 1);
-    uint8_t attribute = this->oam.at(sprite_index + 2);
-    uint8_t x = this->oam.at(sprite_index + 3);
+    uint8_t y = memory_at(this->oam, sprite_index, "oam");
+    uint8_t pattern_table_index = memory_at(this->oam, sprite_index + 1, "oam");
+    uint8_t attribute = memory_at(this->oam, sprite_index + 2, "oam");
+    uint8_t x = memory_at(this->oam, sprite_index + 3, "oam");
     return Sprite(x, y, pattern_table_index, attribute);
 }
 
-void Ppu::receive_oam_dma(uint8_t value) {
+//Copies a whole page into OAM starting at the OAM address and wrapping around, which leaves the OAM address unchanged.
+void Ppu::receive_oam_dma(const uint8_t *page) {
     #ifdef PPU_DEBUG_OUTPUT
-    std::cout << "Receiving oam dma, writing value "
+    std::cout << "Receiving oam dma to address "
               << std::hex
-              << static_cast<unsigned int>(value)
-              << " to address "
               << static_cast<unsigned int>(this->oam_address)
               << std::endl;
     #endif
-    this->oam.at(this->oam_address) = value;
-    this->oam_address++;
+    int until_wrap = OAM_SIZE - this->oam_address;
+    std::copy_n(page, until_wrap, this->oam.begin() + this->oam_address);
+    std::copy_n(page + until_wrap, this->oam_address, this->oam.begin());
+    this->sprite_bins_stale = true;
 }
 
+/* The scanline is built in two passes, first every tile's row of pixel indices and pallete, then all 256 pixels are
+ * looked up in the background half of the resolved pallete in one go. */
 void Ppu::render_background() {
-    int pixel = 0;
-    auto frame_pallete = this->get_frame_pallete();
-    for(int t = 0; t < 32; t++) {
-        int tile_index = BackgroundTile::get_tile_index(pixel, this->scanline);
+    std::array<uint8_t, Frame::WIDTH / 8> palletes;
+    for(int t = 0; t < Frame::WIDTH / 8; t++) {
+        int tile_index = BackgroundTile::get_tile_index(t * 8, this->scanline);
         int pattern_table_index = this->get_pattern_table_index_from_nametable(tile_index, this->get_nametable());
         int attribute_table_index = BackgroundTile::get_attribute_table_index(tile_index);
         int attribute_table_quadrant = BackgroundTile::get_attribute_table_quadrant(tile_index);
-        auto tile_slice = this->get_tile_slice(pattern_table_index,
-                                               this->get_background_pattern_table(),
-                                               this->scanline % 8);
+        const uint8_t *tile_row = this->get_tile_row(pattern_table_index,
+                                                     this->get_background_pattern_table(),
+                                                     this->scanline % 8);
         auto attribute_table = this->get_attribute_table(attribute_table_index, this->get_nametable());
-        for(int x = 0; x < 8; x++) {
-            int pixel_value = tile_slice.get_pixel(x);
-            int pallete = attribute_table.get_pallete(attribute_table_quadrant);
-            int system_pallete_index = frame_pallete.get_backround_color_index(pallete, pixel_value);
-            uint32_t color = SYSTEM_PALLETE.at(system_pallete_index);
-            this->frame->set_pixel(pixel, this->scanline, color);
-            pixel++;
-        }
+        std::copy_n(tile_row, 8, this->background_indices.begin() + t * 8);
+        palletes[t] = attribute_table.get_pallete(attribute_table_quadrant);
     }
+    uint32_t *row = this->frame->get_row(this->scanline);
+    map_scanline(this->background_indices.data(), palletes.data(), this->resolved_pallete.data(), row, Frame::WIDTH / 8);
 }
 
 
-void Ppu::render_sprites() {
-    int sprites_rendered = 0;
-    auto frame_pallete = this->get_frame_pallete();
-    for(int sprite_index = 63; sprite_index >= 0; sprite_index--) {
+//A sprite can only be on the 8 scanlines from its y position down, so only those are tested.
+void Ppu::bin_sprites() {
+    this->sprite_bin_counts.fill(0);
+    for(int sprite_index = 0; sprite_index < OAM_SIZE / 4; sprite_index++) {
         auto sprite = this->get_sprite(sprite_index);
-        if(sprite.is_visible_on_scanline(this->scanline)) {
-            if(sprites_rendered > 7) {
-                this->set_status_flag(StatusFlag::sprite_overflow, true);
-                break;
+        int top = sprite.get_y_position();
+        for(int scanline = top; scanline < top + 8 && scanline < VBLANK_SCANLINE; scanline++) {
+            if(!sprite.is_visible_on_scanline(scanline)) {
+                continue;
+            }
+            uint8_t &count = this->sprite_bin_counts[scanline];
+            if(count < SPRITES_PER_SCANLINE) {
+                this->sprite_bins[scanline][count] = sprite_index;
             }
-            auto tile_slice = this->get_tile_slice(sprite.get_pattern_table_index(),
-                                                   this->get_sprite_pattern_table(),
-                                                   sprite.get_visible_slice(this->scanline));
-            int pallete = sprite.get_attribute(Sprite::Attribute::pallete);
-            for(int x = 0; x < 8 && x + sprite.get_x_position() < this->frame->WIDTH; x++) {
-                int pixel_value = tile_slice.get_pixel(x, sprite.get_attribute(Sprite::Attribute::horizontal_flip));
-                int system_pallete_index = frame_pallete.get_sprite_color_index(pallete, pixel_value);
-                uint32_t color = SYSTEM_PALLETE.at(system_pallete_index);
-                if(color != 0) {
-                    if(!sprite.get_attribute(Sprite::Attribute::priority)) {
-                        this->frame->set_pixel(x + sprite.get_x_position(), this->scanline, color);
-                    }
-                    else {
-                        if(this->frame->get_pixel(x + sprite.get_x_position(), this->scanline) == 0) {
-                            this->frame->set_pixel(x + sprite.get_x_position(), this->scanline, color);
-                        }
-                    }
-                }
+            if(count <= SPRITES_PER_SCANLINE) {
+                count++;
             }
-            sprites_rendered++;
         }
-        else {
-            continue;
+    }
+    this->sprite_bins_stale = false;
+}
+
+/* Only the sprites binned for this scanline are drawn. They're drawn from the highest numbered down, so where they
+ * overlap the lowest numbered one ends up in front. */
+void Ppu::render_sprites() {
+    if(this->sprite_bins_stale) {
+        this->bin_sprites();
+    }
+    int count = this->sprite_bin_counts[this->scanline];
+    if(count > SPRITES_PER_SCANLINE) {
+        this->set_status_flag(StatusFlag::sprite_overflow, true);
+        count = SPRITES_PER_SCANLINE;
+    }
+    uint32_t *row = this->frame->get_row(this->scanline);
+    for(int i = count - 1; i >= 0; i--) {
+        auto sprite = this->get_sprite(this->sprite_bins[this->scanline][i]);
+        const uint8_t *tile_row = this->get_tile_row(sprite.get_pattern_table_index(),
+                                                     this->get_sprite_pattern_table(),
+                                                     sprite.get_visible_slice(this->scanline),
+                                                     sprite.get_attribute(Sprite::Attribute::horizontal_flip));
+        int pallete = sprite.get_attribute(Sprite::Attribute::pallete);
+        const uint32_t *colors = this->resolved_pallete.data() + SPRITE_PALLETES_START + pallete * 4;
+        std::array<uint32_t, 8> pixels;
+        map_tile_row(tile_row, colors, pixels.data());
+        //Sprites hanging off the right edge are cut short rather than wrapping onto the next line.
+        uint32_t *span = row + sprite.get_x_position();
+        int width = std::min(8, Frame::WIDTH - sprite.get_x_position());
+        const uint8_t *background = this->background_indices.data() + sprite.get_x_position();
+        bool behind_background = sprite.get_attribute(Sprite::Attribute::priority);
+        for(int x = 0; x < width; x++) {
+            //Colour 0 is transparent for sprites, and the background is only see through where its index is 0.
+            if(tile_row[x] != 0 && (!behind_background || background[x] == 0)) {
+                span[x] = pixels[x];
+            }
         }
     }
 }
 
+/* The dot in each rendered scanline, and the last one of the frame, where bit 12 of the ppu address rises after being
+ * low for a while, which is what clocks scanline counters like the MMC3's. Background patterns are fetched from dot 1
+ * and sprite patterns from dot 257, with the next line's first background tiles from dot 321, so it depends on which
+ * of them come from the pattern table at $1000. 8x16 sprites count as coming from $1000, since unused sprite slots
+ * fetch tile $ff. Returns -1 when nothing makes it rise once a scanline. */
+int Ppu::get_a12_rise_dot() {
+    if(!this->get_mask_flag(MaskFlag::show_backround) && !this->get_mask_flag(MaskFlag::show_sprites)) {
+        return -1;
+    }
+    if(this->get_controller_flag(ControllerFlag::sprite_size) ||
+       this->get_controller_flag(ControllerFlag::sprite_pattern_table_address)) {
+        return SPRITE_PATTERN_FETCH_DOT;
+    }
+    if(this->get_controller_flag(ControllerFlag::background_pattern_table_address)) {
+        return BACKGROUND_PREFETCH_DOT;
+    }
+    return -1;
+}
+
 void Ppu::render_scanline() {
-    if(this->scanline < 240) {
+    if(this->scanline < VBLANK_SCANLINE) {
         if(this->get_mask_flag(MaskFlag::show_backround)) {
             this->render_background();
         }
+        else {
+            this->background_indices.fill(0);
+        }
         if(this->get_mask_flag(MaskFlag::show_sprites)) {
             this->render_sprites();
         }
     }
     this->scanline++;
-    if(this->scanline == 240) {
+    if(this->scanline == VBLANK_SCANLINE) {
         this->set_status_flag(StatusFlag::vblank, true);
     }
-    if(this->scanline == 261) {
+    if(this->scanline == PRE_RENDER_SCANLINE) {
         this->set_status_flag(StatusFlag::vblank, false);
         this->scanline = 0;
     }
@@ -3,10 +3,10 @@
 #include <cstdint>
 #include <array>
 #include "config.hxx"
+#include "frame.hxx"
 
 //Forward declaration
 class Bus;
-class Frame;
 
 class BackgroundTile {
 public:
@@ -15,14 +15,6 @@ public:
     static int get_attribute_table_quadrant(int);
 };
 
-class TileSlice {
-private:
-    const uint8_t bitplane_a, bitplane_b;
-public:
-    TileSlice(uint8_t, uint8_t);
-    int get_pixel(int, bool flip = false);
-};
-
 class AttributeTable {
 private:
     const uint8_t data;
@@ -31,16 +23,6 @@ public:
     int get_pallete(int);
 };
 
-class FramePallete {
-private:
-    static const int PALLETE_SIZE = 32;
-    const std::array<uint8_t, PALLETE_SIZE>& data;
-public:
-    FramePallete(const std::array<uint8_t, PALLETE_SIZE>&);
-    int get_backround_color_index(int, int);
-    int get_sprite_color_index(int, int);
-};
-
 class Sprite {
 private:
     const uint8_t x, y, pattern_table_index, attribute;
@@ -73,6 +55,11 @@ public:
     static const int PPU_OAM_DMA = 0x4014;
     static const int OAM_SIZE = 256;
     static const int PALLETE_TABLE_SIZE = 32;
+    static const int SPRITE_PALLETES_START = 16;
+    static const int VBLANK_SCANLINE = 240;
+    static const int PRE_RENDER_SCANLINE = 261;
+    //The scanline counter wraps as soon as it reaches the pre-render scanline, so that's how many a frame has.
+    static const int SCANLINES_PER_FRAME = PRE_RENDER_SCANLINE;
 private:
     enum class ControllerFlag {
         base_nametable_address_1        = 0b1,
@@ -99,12 +86,14 @@ private:
         sprite_0_collision = 0b1000000,
         vblank             = 0b10000000
     };
+    static const int SPRITE_PATTERN_FETCH_DOT = 260;
+    static const int BACKGROUND_PREFETCH_DOT = 324;
     enum class ScrollPosition {
         horizontal,
         vertical
     };
 private:
-    const std::array<uint32_t , 64> SYSTEM_PALLETE{0x656565, 0x002d69, 0x131f7f, 0x3c137c, 0x600b62, 0x730a37, 0x710f07,
+    static constexpr std::array<uint32_t , 64> SYSTEM_PALLETE{0x656565, 0x002d69, 0x131f7f, 0x3c137c, 0x600b62, 0x730a37, 0x710f07,
                                                           0x5a1a00, 0x342800, 0x0b3400, 0x003c00, 0x003d10, 0x003840, 0x000000,
                                                           0x000000, 0x000000, 0xaeaeae, 0x0f63b3, 0x4051d0, 0x7841cc, 0xa736a9,
                                                           0xc03470, 0xbd3c30, 0x9f4a00, 0x6d5c00, 0x366d00, 0x077704, 0x00793d,
@@ -114,15 +103,35 @@ private:
                                                           0xbcdfff, 0xd1d8ff, 0xe8d1ff, 0xfbcdfd, 0xffcce5, 0xffcfca, 0xf8d5b4,
                                                           0xe4dca8, 0xcce3a9, 0xb9e8b8, 0xaee8d0, 0xafe5ea, 0xb6b6b6, 0x000000,
                                                           0x000000};
-    uint8_t controller, mask, status, oam_address, data, data_buffer;
+    //The registers start a cache line with OAM and the pallete ram straight after them.
+    alignas(64) uint8_t controller;
+    uint8_t mask, status, oam_address, data, data_buffer;
     uint16_t scroll, address;
     bool address_io_in_progress, scroll_io_in_progress;
-    std::array<uint8_t, 256> oam;
-    std::array<uint8_t, 32> pallete_ram;
+    bool nmi_output;
     int scanline;
-    uint64_t cycles;
     Bus *bus;
     Frame *frame;
+    uint64_t cycles;
+    std::array<uint8_t, 256> oam;
+    std::array<uint8_t, 32> pallete_ram;
+    /* pallete_ram already looked up in the system pallete, with greyscale and colour emphasis applied, so the renderers
+     * index it with the pixel value. It only changes when the pallete ram or the mask does. Colour 0 of every pallete
+     * resolves to the backdrop at $3f00, which is what the ppu shows for transparent background pixels. */
+    std::array<uint32_t, 32> resolved_pallete;
+    void resolve_pallete();
+    void resolve_pallete_entry(int);
+    static int mirror_pallete_address(uint16_t);
+    /* The sprites on each visible scanline in OAM order, like the ppu's secondary OAM, only worked out again after OAM
+     * has been written. A scanline keeps the first 8 and counts up to 9, so the renderer knows to flag an overflow. */
+    static const int SPRITES_PER_SCANLINE = 8;
+    std::array<std::array<uint8_t, SPRITES_PER_SCANLINE>, VBLANK_SCANLINE> sprite_bins;
+    std::array<uint8_t, VBLANK_SCANLINE> sprite_bin_counts;
+    bool sprite_bins_stale;
+    void bin_sprites();
+    //Pallete indices of the background pixels on the scanline being drawn, sprites behind the background show where
+    //they're 0. Zeroed when the background isn't shown.
+    std::array<uint8_t, Frame::WIDTH> background_indices;
     int get_nametable();
     int get_sprite_pattern_table();
     int get_background_pattern_table();
@@ -130,12 +139,12 @@ private:
     int get_pallete_from_attribute_table(int, int, int);
     int get_backround_color_from_frame_pallete(int, int);
     int get_pattern_table_index_from_nametable(int, int);
-    TileSlice get_tile_slice(int, int, int);
+    const uint8_t *get_tile_row(int, int, int, bool flip = false);
     AttributeTable get_attribute_table(int, int);
-    FramePallete get_frame_pallete();
     Sprite get_sprite(int);
     void render_background();
     void render_sprites();
+    void update_nmi_output();
 public:
     Ppu();
     void reset();
@@ -167,11 +176,11 @@ public:
     uint8_t read_data();
     void write_pallete_ram(uint16_t, uint8_t);
     uint8_t read_pallete_ram(uint16_t);
-    bool poll_nmi_interrupt();
     void render_scanline();
     void catch_up(int);
     int get_scanline() {return this->scanline;};
-    void receive_oam_dma(uint8_t);
+    int get_a12_rise_dot();
+    void receive_oam_dma(const uint8_t*);
 };
 
 #ifdef UNITTEST
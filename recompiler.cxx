@@ -0,0 +1,144 @@
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <stdexcept>
+#include "system.hxx"
+#include "mapper.hxx"
+
+/* Walks the code reachable from the interrupt vectors of an NROM image and writes it out as C++, one switch case per
+ * basic block, which cpu.cxx includes when built with RECOMPILED_ROM. Blocks are cut exactly the way the runtime block
+ * translator cuts them, so anything that touches I/O or changes the program counter still goes back through the
+ * interpreter loop. Targets that can't be known ahead of time (JMP indirect, RTS, RTI) aren't followed, the
+ * interpreter runs whatever they land on until it reaches the start of a recompiled block again. */
+
+class Recompiler {
+private:
+    static const uint8_t OPCODE_JSR = 0x20;
+    static const uint8_t OPCODE_JMP_ABSOLUTE = 0x4c;
+    Cpu &cpu;
+    std::map<uint16_t, Cpu::TranslatedBlock> blocks;
+    std::deque<uint16_t> pending;
+    void queue(int);
+    std::set<uint16_t> successors(const Cpu::TranslatedBlock&);
+public:
+    Recompiler(Cpu&);
+    void walk();
+    void emit(std::ostream&, const char*);
+};
+
+Recompiler::Recompiler(Cpu &cpu) : cpu(cpu) {}
+
+void Recompiler::queue(int address) {
+    if(address >= Bus::ROM_START && address <= Bus::ROM_END && this->blocks.count(address) == 0) {
+        this->pending.push_back(address);
+    }
+}
+
+std::set<uint16_t> Recompiler::successors(const Cpu::TranslatedBlock &block) {
+    std::set<uint16_t> next;
+    int end = block.address;
+    for(const auto &step : block.steps) {
+        end += step.instruction->length;
+    }
+    const Cpu::TranslatedStep &last = block.steps.back();
+    if(last.instruction->addressing_mode == Cpu::AddressingMode::relative) {
+        next.insert(end);
+        next.insert(end + static_cast<int8_t>(last.operand));
+    }
+    else if(last.opcode == OPCODE_JMP_ABSOLUTE) {
+        next.insert(last.operand);
+    }
+    else if(last.opcode == OPCODE_JSR) {
+        next.insert(last.operand);
+        next.insert(end);
+    }
+    else if(!last.instruction->sets_program_counter && last.instruction->handler != &Cpu::illegal_opcode) {
+        next.insert(end);
+    }
+    //BRK goes through the IRQ vector, which is already walked from the start.
+    return next;
+}
+
+void Recompiler::walk() {
+    this->queue(this->cpu.bus->read_ram_16(Cpu::RESET_INTERRUPT_VECTOR));
+    this->queue(this->cpu.bus->read_ram_16(Cpu::NMI_INTERRUPT_VECTOR));
+    this->queue(this->cpu.bus->read_ram_16(Cpu::IRQ_INTERRUPT_VECTOR));
+    while(!this->pending.empty()) {
+        uint16_t address = this->pending.front();
+        this->pending.pop_front();
+        if(this->blocks.count(address) != 0) {
+            continue;
+        }
+        int bank = this->cpu.bus->rom->get_prgrom_bank(address - Bus::ROM_START);
+        Cpu::TranslatedBlock block = this->cpu.translate_block(address, bank);
+        if(block.steps.empty()) {
+            continue;
+        }
+        for(uint16_t next : this->successors(block)) {
+            this->queue(next);
+        }
+        this->blocks.emplace(address, std::move(block));
+    }
+}
+
+void Recompiler::emit(std::ostream &out, const char *rom_path) {
+    out << std::hex << std::setfill('0');
+    out << "/* Generated by nesxx-recompile from " << rom_path << ", rerun it instead of editing this file. */\n\n";
+    out << "const uint64_t Cpu::RECOMPILED_PRGROM_HASH = 0x" << this->cpu.hash_prgrom() << "ull;\n\n";
+    out << "bool Cpu::run_recompiled_block(uint64_t target) {\n";
+    out << "    switch(this->program_counter) {\n";
+    for(const auto &entry : this->blocks) {
+        const Cpu::TranslatedBlock &block = entry.second;
+        out << "        case 0x" << std::setw(4) << block.address << ":\n";
+        out << "            if(this->cycles + " << std::dec << block.cycle_budget << std::hex << " >= target) {\n";
+        out << "                return false;\n";
+        out << "            }\n";
+        for(const auto &step : block.steps) {
+            out << "            this->recompiled_step<0x" << std::setw(2) << static_cast<int>(step.opcode) << ">(0x"
+                << std::setw(4) << step.operand << ");\n";
+        }
+        if(block.steps.size() > 1) {
+            out << "            this->iterations += " << std::dec << block.steps.size() - 1 << std::hex << ";\n";
+        }
+        out << "            break;\n";
+    }
+    out << "        default:\n";
+    out << "            return false;\n";
+    out << "    }\n";
+    out << "    this->finish_instruction();\n";
+    out << "    return true;\n";
+    out << "}\n";
+}
+
+int main(int argc, char **argv) {
+    if(argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <rom.nes> <output.inc>\n";
+        return 1;
+    }
+    std::unique_ptr<System> system;
+    try {
+        system = std::make_unique<System>(argv[1]);
+    }
+    catch(const std::runtime_error &e) {
+        std::cerr << argv[1] << ": " << e.what() << "\n";
+        return 1;
+    }
+    if(system->rom.get_mapper_number() != Mapper::NROM) {
+        std::cerr << argv[1] << ": only NROM images can be compiled, this one uses mapper "
+                  << system->rom.get_mapper_number() << "\n";
+        return 1;
+    }
+    Recompiler recompiler(system->cpu);
+    recompiler.walk();
+    std::ofstream out(argv[2]);
+    if(!out.is_open()) {
+        std::cerr << "Error opening " << argv[2] << "\n";
+        return 1;
+    }
+    recompiler.emit(out, argv[1]);
+    return 0;
+}
@@ -1,43 +1,181 @@
 #include <iostream>
-#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "rom.hxx"
+#include "mapper.hxx"
+#include "access.hxx"
+#include "pixel_kernels.hxx"
 
+Rom::Rom() {
+    this->prgram_buffer.resize(PRGRAM_SIZE);
+    this->prgram = this->prgram_buffer.data();
+    this->save_file = -1;
+    this->image = nullptr;
+    this->image_size = 0;
+    this->prgrom = {nullptr, 0};
+    this->chrrom = {nullptr, 0};
+    this->mapper_number = Mapper::NROM;
+    this->chrrom_is_ram = false;
+    this->prgrom_windows.fill(nullptr);
+    this->prgrom_banks.fill(0);
+    this->chrrom_windows.fill(nullptr);
+    this->decoded_chr_windows.fill(nullptr);
+}
+
+Rom::~Rom() {
+    if(this->save_file != -1) {
+        this->sync_prgram(true);
+        munmap(this->prgram, PRGRAM_SIZE);
+        close(this->save_file);
+    }
+    if(this->image != nullptr) {
+        munmap(this->image, this->image_size);
+    }
+}
+
+/* The save file is created empty if there isn't one yet, and grown to the size of the PRG-RAM if it's shorter. A longer
+ * one is left as it is and only its start is mapped, whatever else is in it may belong to another emulator. */
+void Rom::map_save_file(const std::string &path) {
+    int file = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if(file == -1) {
+        throw std::runtime_error("Error opening save file " + path + ": " + std::strerror(errno));
+    }
+    struct stat file_status;
+    if(fstat(file, &file_status) == -1) {
+        close(file);
+        throw std::runtime_error("Error reading save file " + path + ": " + std::strerror(errno));
+    }
+    if(file_status.st_size < PRGRAM_SIZE && ftruncate(file, PRGRAM_SIZE) == -1) {
+        close(file);
+        throw std::runtime_error("Error sizing save file " + path + ": " + std::strerror(errno));
+    }
+    void *memory = mmap(nullptr, PRGRAM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+    if(memory == MAP_FAILED) {
+        close(file);
+        throw std::runtime_error("Error mapping save file " + path + ": " + std::strerror(errno));
+    }
+    this->save_file = file;
+    this->prgram = static_cast<uint8_t*>(memory);
+}
+
+//Without a writable save file the game still gets whatever was saved before, it just can't save again.
+void Rom::load_save_file(const std::string &path) {
+    int file = open(path.c_str(), O_RDONLY);
+    if(file == -1) {
+        return;
+    }
+    ssize_t size = read(file, this->prgram_buffer.data(), PRGRAM_SIZE);
+    close(file);
+    if(size == -1) {
+        std::fill(this->prgram_buffer.begin(), this->prgram_buffer.end(), 0);
+    }
+}
+
+/* Writes the PRG-RAM back to the save file. At the end of a frame it only starts the write back, on exit it waits for
+ * it to finish. */
+void Rom::sync_prgram(bool wait) {
+    if(this->save_file != -1) {
+        msync(this->prgram, PRGRAM_SIZE, wait ? MS_SYNC : MS_ASYNC);
+    }
+}
+
+//Maps the file read only, the descriptor isn't needed once the mapping exists.
+void Rom::map_image(const char *filepath) {
+    int file = open(filepath, O_RDONLY);
+    if(file == -1) {
+        throw std::runtime_error(std::string("Error opening rom file ") + filepath + ": " + std::strerror(errno));
+    }
+    struct stat file_status;
+    if(fstat(file, &file_status) == -1) {
+        close(file);
+        throw std::runtime_error(std::string("Error reading rom file ") + filepath + ": " + std::strerror(errno));
+    }
+    if(file_status.st_size < HEADER_SIZE) {
+        close(file);
+        throw std::runtime_error("Rom file is too short to have a header");
+    }
+    void *memory = mmap(nullptr, file_status.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if(memory == MAP_FAILED) {
+        throw std::runtime_error(std::string("Error mapping rom file ") + filepath + ": " + std::strerror(errno));
+    }
+    this->image = static_cast<uint8_t*>(memory);
+    this->image_size = file_status.st_size;
+}
+
+/* NES 2.0 sizes are a 12 bit count of units, unless the upper 4 bits are all set, then the lower byte is an exponent
+ * and a multiplier, 2^E * (MM * 2 + 1). */
+size_t Rom::get_nes2_rom_size(uint8_t lsb, uint8_t msb, size_t unit_size) {
+    if(msb != 0xf) {
+        return (msb << 8 | lsb) * unit_size;
+    }
+    int exponent = lsb >> 2;
+    if(exponent >= 32) {
+        throw std::runtime_error("Rom header gives a size that's too large");
+    }
+    return (static_cast<size_t>(1) << exponent) * ((lsb & 0b11) * 2 + 1);
+}
 
 void Rom::load_from_file(const char* filepath) {
-    std::ifstream f(filepath, std::ifstream::binary | std::ifstream::ate);
-    if(!f.is_open())
-        throw std::runtime_error("Error reading rom file");
-    size_t length = f.tellg();
-    f.seekg(f.beg);
-    std::vector<char> v(length);
-    f.read(v.data(), length);
-    std::string rom_header;
-    rom_header.push_back(v.at(0));
-    rom_header.push_back(v.at(1));
-    rom_header.push_back(v.at(2));
-    if(rom_header != "NES")
+    this->map_image(filepath);
+    const uint8_t *header = this->image;
+    if(std::memcmp(header, "NES\x1a", 4) != 0) {
         throw std::runtime_error("Rom header is incorrect");
-    std::cout << "Trying to load bytes from ROM!\n";
-    for(auto x: v)
-        this->rom.push_back(static_cast<uint8_t>(x));
-    std::cout << "Initial ROM loading sucessful!\n";
-    bool trainer_present = rom.at(6) & 0b100;
-    int prgrom_size = rom.at(4) * PRGROM_UNIT_SIZE;
-    int chrrom_size = rom.at(5) * CHRROM_UNIT_SIZE;
-    int prgrom_offset = HEADER_SIZE + (trainer_present * TRAINER_SIZE);
-    int chrrom_offset = prgrom_offset + prgrom_size;
-    std::cout << "Preparing to read prgrom, total size " << prgrom_size << "\n";
-    for(int x = 0; x < prgrom_size; x++)
-        this->prgrom.push_back(rom.at(x + prgrom_offset));
-    std::cout << "Loaded prgrom sucessfully!\n";
-    std::cout << "Trying to read chrom, total size " << chrrom_size << "\n";
-    for(int x = 0; x < chrrom_size; x++)
-        this->chrrom.push_back(rom.at(x + chrrom_offset));
-    std::cout << "Loaded chrrom successfully!\n";
-    this->mapper = Mapper::nrom;
-    std::cout << "Setting mapper type to NROM!\n";
-    uint8_t flag = this->rom.at(6);
-    if(flag & 0b1) {
+    }
+    int mapper_number = header[6] >> 4 | (header[7] & 0xf0);
+    size_t prgrom_size, chrrom_size;
+    size_t chrram_size = CHRROM_UNIT_SIZE;
+    if((header[7] & 0b1100) == 0b1000) {
+        prgrom_size = get_nes2_rom_size(header[4], header[9] & 0xf, PRGROM_UNIT_SIZE);
+        chrrom_size = get_nes2_rom_size(header[5], header[9] >> 4, CHRROM_UNIT_SIZE);
+        mapper_number |= (header[8] & 0xf) << 8;
+        if(header[11] & 0xf) {
+            chrram_size = std::max<size_t>(64 << (header[11] & 0xf), CHRROM_UNIT_SIZE);
+        }
+    }
+    else {
+        prgrom_size = header[4] * PRGROM_UNIT_SIZE;
+        chrrom_size = header[5] * CHRROM_UNIT_SIZE;
+        //Old dumping tools left their name in bytes 7-15, where it would read as the upper half of the mapper number.
+        bool padding_used = std::any_of(header + 12, header + HEADER_SIZE, [](uint8_t x) {return x != 0;});
+        if((header[7] & 0b1100) != 0 || padding_used) {
+            mapper_number &= 0xf;
+        }
+    }
+    if(prgrom_size == 0 || prgrom_size % PRGROM_BANK_SIZE != 0 || chrrom_size % CHRROM_BANK_SIZE != 0) {
+        throw std::runtime_error("Rom header gives PRG-ROM or CHR-ROM sizes that aren't whole banks");
+    }
+    size_t prgrom_offset = HEADER_SIZE + (header[6] & 0b100 ? TRAINER_SIZE : 0);
+    size_t chrrom_offset = prgrom_offset + prgrom_size;
+    if(chrrom_offset + chrrom_size > this->image_size) {
+        throw std::runtime_error("Rom file is truncated, the header needs " +
+                                 std::to_string(chrrom_offset + chrrom_size) + " bytes but there are only " +
+                                 std::to_string(this->image_size));
+    }
+    this->prgrom = {this->image + prgrom_offset, prgrom_size};
+    if(chrrom_size == 0) {
+        this->chrram.assign(chrram_size, 0);
+        this->chrrom = {this->chrram.data(), chrram_size};
+        this->chrrom_is_ram = true;
+    }
+    else {
+        this->chrrom = {this->image + chrrom_offset, chrrom_size};
+    }
+    this->decode_chr();
+    std::cout << "Loaded " << prgrom_size / 1024 << "KB of PRG-ROM and "
+              << (this->chrrom_is_ram ? chrram_size : chrrom_size) / 1024 << "KB of CHR-"
+              << (this->chrrom_is_ram ? "RAM" : "ROM") << "\n";
+    uint8_t flag = header[6];
+    if(flag & 0b1000) {
+        this->mirroring_type = MirroringType::four_screen;
+        std::cout << "Setting mirroring type to four screen!\n";
+    }
+    else if(flag & 0b1) {
         this->mirroring_type = MirroringType::vertical;
         std::cout << "Setting mirroring type to vertical!\n";
     }
@@ -45,41 +183,111 @@ void Rom::load_from_file(const char* filepath) {
         this->mirroring_type = MirroringType::horizontal;
         std::cout << "Setting mirroring type to horizontal!\n";
     }
+    this->create_mapper(mapper_number);
+    std::cout << "Setting mapper type to " << this->mapper_number << "!\n";
+    if(flag & 0b10) {
+        std::string save_path(filepath);
+        size_t extension = save_path.find_last_of('.');
+        if(extension != std::string::npos && save_path.find('/', extension) == std::string::npos) {
+            save_path.erase(extension);
+        }
+        save_path += ".sav";
+        try {
+            this->map_save_file(save_path);
+            std::cout << "Mapped battery backed PRG-RAM to " << save_path << "\n";
+        }
+        catch(const std::runtime_error &e) {
+            this->load_save_file(save_path);
+            std::cerr << e.what() << ", PRG-RAM won't be saved\n";
+        }
+    }
 }
 
 
-uint16_t Rom::trunacate_prgrom_address(uint16_t address) {
-    if(this->prgrom.size() == PRGROM_UNIT_SIZE) {
-        return address & (PRGROM_UNIT_SIZE - 1);
-    }
-    if(this->prgrom.size() == PRGROM_UNIT_SIZE * 2) {
-        return address & ((PRGROM_UNIT_SIZE * 2) - 1);
-    }
-    return address;
+void Rom::create_mapper(int number) {
+    this->mapper = Mapper::create(number, *this);
+    this->mapper_number = number;
+    this->mapper->reset();
 }
 
+//Addresses are relative to $8000.
 uint8_t Rom::read_prgrom(uint16_t address) {
-    address = this->trunacate_prgrom_address(address);
-    return this->prgrom.at(address);
+    return memory_at(this->prgrom_windows, address / PRGROM_BANK_SIZE, "prgrom")[address % PRGROM_BANK_SIZE];
+}
+
+//Which 8KB bank of PRG-ROM is visible at the given address right now.
+int Rom::get_prgrom_bank(uint16_t address) {
+    return memory_at(this->prgrom_banks, address / PRGROM_BANK_SIZE, "prgrom");
+}
+
+//Host address of the PRG-ROM byte visible at the given address, for the bus to map a whole page at once.
+uint8_t *Rom::get_prgrom_page(uint16_t address) {
+    uint8_t *window = memory_at(this->prgrom_windows, address / PRGROM_BANK_SIZE, "prgrom");
+    return window != nullptr ? window + address % PRGROM_BANK_SIZE : nullptr;
 }
 
 uint8_t Rom::read_chrrom(uint16_t address) {
-    return this->chrrom.at(address);
+    return memory_at(this->chrrom_windows, address / CHRROM_BANK_SIZE, "chrrom")[address % CHRROM_BANK_SIZE];
+}
+
+//Only CHR-RAM can be written, writes to CHR-ROM are dropped. The row of the tile that changed is decoded again.
+void Rom::write_chrrom(uint16_t address, uint8_t value) {
+    if(this->chrrom_is_ram) {
+        uint8_t *window = memory_at(this->chrrom_windows, address / CHRROM_BANK_SIZE, "chrrom");
+        window[address % CHRROM_BANK_SIZE] = value;
+        this->decode_chr_row(window - this->chrrom.data + address % CHRROM_BANK_SIZE);
+    }
+}
+
+void Rom::decode_chr() {
+    this->decoded_chr.resize(this->chrrom.size / CHR_TILE_SIZE);
+    for(size_t offset = 0; offset < this->chrrom.size; offset += CHR_TILE_SIZE) {
+        for(int row = 0; row < 8; row++) {
+            this->decode_chr_row(offset + row);
+        }
+    }
+}
+
+//Either bitplane byte of a tile row can be given, the low plane is 8 bytes before the high one.
+void Rom::decode_chr_row(size_t offset) {
+    size_t tile_offset = offset - offset % CHR_TILE_SIZE;
+    int row = offset % 8;
+    uint8_t bitplane_a = this->chrrom.data[tile_offset + row];
+    uint8_t bitplane_b = this->chrrom.data[tile_offset + row + 8];
+    DecodedTile &tile = this->decoded_chr[offset / CHR_TILE_SIZE];
+    expand_bitplanes(bitplane_a, bitplane_b, tile.rows[row].data(), tile.flipped_rows[row].data());
+}
+
+//The 8 pixels of one tile row, the address is the row's low bitplane in the pattern tables.
+const uint8_t *Rom::get_tile_row(uint16_t address, bool flipped) {
+    DecodedTile *window = memory_at(this->decoded_chr_windows, address / CHRROM_BANK_SIZE, "chrrom");
+    DecodedTile &tile = window[address % CHRROM_BANK_SIZE / CHR_TILE_SIZE];
+    return flipped ? tile.flipped_rows[address % 8].data() : tile.rows[address % 8].data();
+}
+
+//Addresses are the full cpu address, most mappers decode some of the upper bits.
+//Returns the Mapper::Change flags for what the write switched.
+uint8_t Rom::write_mapper(uint16_t address, uint8_t value) {
+    return this->mapper->write_register(address, value);
 }
 
 #ifdef UNITTEST
 
 DummyRom::DummyRom() {
-    this->prgrom.resize(PRGROM_UNIT_SIZE * 2);
-    this->chrrom.resize(CHRROM_UNIT_SIZE);
+    this->memory.resize(PRGROM_UNIT_SIZE * 2 + CHRROM_UNIT_SIZE);
+    this->prgrom = {this->memory.data(), PRGROM_UNIT_SIZE * 2};
+    this->chrrom = {this->memory.data() + PRGROM_UNIT_SIZE * 2, CHRROM_UNIT_SIZE};
+    this->mirroring_type = MirroringType::horizontal;
+    this->decode_chr();
+    this->create_mapper(Mapper::NROM);
 }
 
 uint8_t DummyRom::read_prgrom(uint16_t address) {
-    return this->prgrom.at(address);
+    return this->memory.at(address);
 }
 
 uint8_t DummyRom::read_chrrom(uint16_t address) {
-    return this->chrrom.at(address);
+    return this->memory.at(PRGROM_UNIT_SIZE * 2 + address);
 }
 
 #endif
\ No newline at end of file
@@ -2,34 +2,97 @@
 #define ROM_H
 #include <cstdint>
 #include <vector>
+#include <array>
+#include <string>
+#include <memory>
 #include <config.hxx>
 
+//Forward declaration
+class Mapper;
+
 class Rom {
+    friend class Mapper;
 private:
     static const int HEADER_SIZE = 16;
     static const int TRAINER_SIZE = 512;
     static const int PRGROM_UNIT_SIZE = 16384;
     static const int CHRROM_UNIT_SIZE = 8192;
+    //A run of bytes inside the mapped image, or inside chrram for carts without CHR-ROM.
+    struct Span {
+        uint8_t *data;
+        size_t size;
+    };
 public:
+    static const int PRGROM_BANK_SIZE = 8192;
+    static const int CHRROM_BANK_SIZE = 1024;
+    static const int PRGROM_WINDOWS = 4;
+    static const int CHRROM_WINDOWS = 8;
+    static const int PRGRAM_SIZE = 8192;
+    static const int CHR_TILE_SIZE = 16;
+    /* A CHR tile with its two bitplanes already combined into one 2 bit pixel index per byte, and again mirrored for
+     * sprites that are flipped horizontally, so the ppu can copy a row of pixels straight out of it. */
+    struct DecodedTile {
+        std::array<std::array<uint8_t, 8>, 8> rows;
+        std::array<std::array<uint8_t, 8>, 8> flipped_rows;
+    };
     enum class MirroringType{
         horizontal,
-        vertical
+        vertical,
+        single_screen_lower,
+        single_screen_upper,
+        four_screen
     };
 private:
-    enum class Mapper {
-        nrom
-    };
-private:
-    Mapper mapper;
-    std::vector<uint8_t> rom;
-    std::vector<uint8_t> prgrom;
-    std::vector<uint8_t> chrrom;
-    uint16_t trunacate_prgrom_address(uint16_t);
+    int mapper_number;
+    std::unique_ptr<Mapper> mapper;
+    /* The whole .nes file mapped read only. PRG-ROM and CHR-ROM are spans straight into it, so loading copies nothing
+     * and roms loaded by several processes share the page cache. Nothing ever writes through them, the bus leaves
+     * PRG-ROM writes to the mapper and CHR-ROM writes are dropped. */
+    uint8_t *image;
+    size_t image_size;
+    Span prgrom;
+    Span chrrom;
+    //Carts without CHR-ROM have CHR-RAM in its place, 8KB unless a NES 2.0 header says otherwise.
+    bool chrrom_is_ram;
+    std::vector<uint8_t> chrram;
+    void map_image(const char*);
+    static size_t get_nes2_rom_size(uint8_t, uint8_t, size_t);
+    /* The mapper points each 8KB window of $8000-$ffff and each 1KB window of the pattern tables at one of the banks,
+     * so reads never have to work out which bank they're in. prgrom_banks remembers which bank each window shows. */
+    std::array<uint8_t*, PRGROM_WINDOWS> prgrom_windows;
+    std::array<int, PRGROM_WINDOWS> prgrom_banks;
+    std::array<uint8_t*, CHRROM_WINDOWS> chrrom_windows;
+    //All of CHR decoded once when it's loaded, the windows point into it the same way as into chrrom.
+    std::vector<DecodedTile> decoded_chr;
+    std::array<DecodedTile*, CHRROM_WINDOWS> decoded_chr_windows;
+    void decode_chr();
+    void decode_chr_row(size_t);
+    void create_mapper(int);
     MirroringType mirroring_type;
+    /* Work RAM at $6000-$7fff. With a battery it's the .sav file beside the rom mapped into memory, so saving costs
+     * nothing until sync_prgram, otherwise it's just prgram_buffer. So is a battery whose .sav can't be written. */
+    uint8_t *prgram;
+    std::vector<uint8_t> prgram_buffer;
+    int save_file;
+    void map_save_file(const std::string&);
+    void load_save_file(const std::string&);
 public:
+    Rom();
+    ~Rom();
+    Rom(const Rom&) = delete;
+    Rom &operator=(const Rom&) = delete;
     void load_from_file(const char*);
     uint8_t read_prgrom(uint16_t);
+    int get_prgrom_bank(uint16_t);
+    uint8_t *get_prgrom_page(uint16_t);
     uint8_t read_chrrom(uint16_t);
+    void write_chrrom(uint16_t, uint8_t);
+    const uint8_t *get_tile_row(uint16_t, bool flipped = false);
+    uint8_t write_mapper(uint16_t, uint8_t);
+    int get_mapper_number() {return this->mapper_number;};
+    Mapper *get_mapper() {return this->mapper.get();};
+    uint8_t *get_prgram() {return this->prgram;};
+    void sync_prgram(bool wait = false);
     MirroringType get_mirroring_type() {return this->mirroring_type;};
 
 };
@@ -37,6 +100,8 @@ public:
 #ifdef UNITTEST
 
 class DummyRom : public Rom {
+private:
+    std::vector<uint8_t> memory;
 public:
     DummyRom();
     uint8_t read_prgrom(uint16_t);
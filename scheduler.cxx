@@ -0,0 +1,172 @@
+#include <algorithm>
+#include "scheduler.hxx"
+#include "cpu.hxx"
+#include "ppu.hxx"
+#include "rom.hxx"
+#include "mapper.hxx"
+#include "interrupt.hxx"
+
+//The rendered scanlines and the pre-render one each clock a scanline counter once.
+static const int64_t DOTS_PER_FRAME = Ppu::SCANLINES_PER_FRAME * Scheduler::DOTS_PER_SCANLINE;
+static const int64_t SCANLINE_CLOCKS_PER_FRAME = Ppu::VBLANK_SCANLINE + 1;
+
+static int64_t floor_divide(int64_t value, int64_t divisor) {
+    return value / divisor - (value % divisor < 0);
+}
+
+Scheduler::Scheduler() {
+    this->now = 0;
+    this->sequence = 0;
+    this->frame_complete = false;
+    this->scanline_start = 0;
+    this->scanline_counter = nullptr;
+    this->scanline_counter_synced_at = 0;
+    this->mapper_irq_time = NEVER;
+    this->mapper_irq_generation = 0;
+    this->cpu = nullptr;
+    this->ppu = nullptr;
+    this->rom = nullptr;
+    this->interrupts = nullptr;
+}
+
+void Scheduler::connect_cpu(Cpu *cpu) {
+    this->cpu = cpu;
+}
+
+void Scheduler::connect_ppu(Ppu *ppu) {
+    this->ppu = ppu;
+}
+
+void Scheduler::connect_rom(Rom *rom) {
+    this->rom = rom;
+}
+
+void Scheduler::connect_interrupts(InterruptLines *interrupts) {
+    this->interrupts = interrupts;
+}
+
+//Starts the clock from wherever the cpu is, with the ppu one scanline away from finishing the current one.
+void Scheduler::reset() {
+    this->events = {};
+    this->now = this->cpu->get_cycles() * DOTS_PER_CPU_CYCLE;
+    this->scanline_start = this->now;
+    this->schedule(EventType::ppu_scanline, this->now + DOTS_PER_SCANLINE);
+    Mapper *mapper = this->rom->get_mapper();
+    this->scanline_counter = mapper->counts_scanlines() ? mapper : nullptr;
+    this->scanline_counter_synced_at = this->now;
+    this->mapper_irq_time = NEVER;
+    this->mapper_irq_generation++;
+    this->schedule_mapper_irq();
+}
+
+void Scheduler::schedule(EventType type, uint64_t time, uint32_t generation) {
+    this->events.push({time, this->sequence++, type, generation});
+}
+
+void Scheduler::dispatch(const Event &event) {
+    switch(event.type) {
+        case EventType::ppu_scanline:
+            this->ppu->render_scanline();
+            this->scanline_start = event.time;
+            this->schedule(EventType::ppu_scanline, event.time + DOTS_PER_SCANLINE);
+            if(this->ppu->get_scanline() == Ppu::VBLANK_SCANLINE) {
+                this->frame_complete = true;
+            }
+            break;
+        case EventType::mapper_irq:
+            if(event.generation == this->mapper_irq_generation) {
+                this->sync_mapper_irq(event.time);
+                this->schedule_mapper_irq();
+            }
+            break;
+    }
+}
+
+/* Scanline counters */
+
+//Every scanline is the same length, so the start of the frame follows from the scanline the ppu is on.
+int64_t Scheduler::get_frame_start() {
+    return static_cast<int64_t>(this->scanline_start) - this->ppu->get_scanline() * DOTS_PER_SCANLINE;
+}
+
+/* How many times the counter is clocked at the given dot of each scanline up to and including time, counted from the
+ * start of the current frame. Times before it give negative counts, only the difference between two counts matters. */
+int64_t Scheduler::count_scanline_clocks(uint64_t time, int dot) {
+    int64_t since_frame_start = static_cast<int64_t>(time) - this->get_frame_start();
+    int64_t frames = floor_divide(since_frame_start, DOTS_PER_FRAME);
+    int64_t into_frame = since_frame_start - frames * DOTS_PER_FRAME;
+    int64_t scanlines = into_frame < dot ? 0 : (into_frame - dot) / DOTS_PER_SCANLINE + 1;
+    int64_t clocks = std::min<int64_t>(scanlines, Ppu::VBLANK_SCANLINE) + (scanlines == Ppu::SCANLINES_PER_FRAME);
+    return frames * SCANLINE_CLOCKS_PER_FRAME + clocks;
+}
+
+//When the clock numbered the same way as count_scanline_clocks happens, the first one of the frame being clock 0.
+uint64_t Scheduler::get_scanline_clock_time(int64_t clock, int dot) {
+    int64_t frames = floor_divide(clock, SCANLINE_CLOCKS_PER_FRAME);
+    int64_t index = clock - frames * SCANLINE_CLOCKS_PER_FRAME;
+    int64_t scanline = index < Ppu::VBLANK_SCANLINE ? index : Ppu::SCANLINES_PER_FRAME - 1;
+    return this->get_frame_start() + frames * DOTS_PER_FRAME + scanline * DOTS_PER_SCANLINE + dot;
+}
+
+/* Gives the counter every clock since it was last caught up. The ppu registers and the mapper's own can only change
+ * when this is called first, so the clocks all came at the same dot. If the counter reached zero on the way the IRQ
+ * is asserted, a write that came a few cycles after the predicted event catches it the same way. */
+void Scheduler::sync_mapper_irq(uint64_t time) {
+    if(this->scanline_counter == nullptr || time <= this->scanline_counter_synced_at) {
+        return;
+    }
+    int dot = this->ppu->get_a12_rise_dot();
+    if(dot != -1) {
+        int64_t clocks = this->count_scanline_clocks(time, dot) -
+                         this->count_scanline_clocks(this->scanline_counter_synced_at, dot);
+        if(clocks > 0 && this->scanline_counter->clock_scanline_counter(clocks)) {
+            this->interrupts->assert_line(InterruptLines::Line::irq,
+                                          (time + DOTS_PER_CPU_CYCLE - 1) / DOTS_PER_CPU_CYCLE);
+        }
+    }
+    this->scanline_counter_synced_at = time;
+}
+
+//Catches the counter up to the cpu, for before a write that can change how or whether it's clocked.
+void Scheduler::sync_mapper_irq() {
+    this->sync_mapper_irq(this->cpu->get_cycles() * DOTS_PER_CPU_CYCLE);
+}
+
+/* Works out when the counter next raises an IRQ and schedules it, unless that's when it's already scheduled. The event
+ * that was pending is left in the queue and ignored when it comes up. A disabled IRQ is also acknowledged here. */
+void Scheduler::schedule_mapper_irq() {
+    if(this->scanline_counter == nullptr) {
+        return;
+    }
+    if(!this->scanline_counter->is_irq_enabled()) {
+        this->interrupts->release_line(InterruptLines::Line::irq);
+    }
+    uint64_t time = NEVER;
+    int dot = this->ppu->get_a12_rise_dot();
+    int64_t clocks = this->scanline_counter->get_clocks_until_irq();
+    if(dot != -1 && clocks > 0) {
+        int64_t synced = this->count_scanline_clocks(this->scanline_counter_synced_at, dot);
+        time = this->get_scanline_clock_time(synced + clocks - 1, dot);
+    }
+    if(time == this->mapper_irq_time) {
+        return;
+    }
+    this->mapper_irq_time = time;
+    this->mapper_irq_generation++;
+    if(time != NEVER) {
+        this->schedule(EventType::mapper_irq, time, this->mapper_irq_generation);
+    }
+}
+
+//Runs until the ppu reaches vblank, which is when the frame is ready to be shown.
+void Scheduler::run_frame() {
+    this->frame_complete = false;
+    while(!this->frame_complete) {
+        Event event = this->events.top();
+        this->events.pop();
+        //The cpu can't stop part way through a cycle, so it runs until its clock has caught up with the event.
+        this->cpu->run_until((event.time + DOTS_PER_CPU_CYCLE - 1) / DOTS_PER_CPU_CYCLE);
+        this->now = event.time;
+        this->dispatch(event);
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef SCHEDULER_HXX
+#define SCHEDULER_HXX
+#include <cstdint>
+#include <vector>
+#include <queue>
+#include <functional>
+
+//Forward declaration
+class Cpu;
+class Ppu;
+class Rom;
+class Mapper;
+class InterruptLines;
+
+/* Keeps the master clock, counted in ppu dots, and a queue of upcoming component events ordered by time. The cpu runs
+ * uninterrupted up to the next event, then the event is handled, which usually schedules the next one. Events at the
+ * same time are handled in the order they were scheduled. */
+
+class Scheduler {
+public:
+    static const int DOTS_PER_CPU_CYCLE = 3;
+    static const int DOTS_PER_SCANLINE = 341;
+    enum class EventType {
+        ppu_scanline,
+        mapper_irq
+    };
+private:
+    static const uint64_t NEVER = UINT64_MAX;
+    //Events scheduled before the last reschedule of the same kind carry an older generation and are dropped.
+    struct Event {
+        uint64_t time;
+        uint64_t sequence;
+        EventType type;
+        uint32_t generation;
+        bool operator>(const Event &other) const {
+            return this->time > other.time || (this->time == other.time && this->sequence > other.sequence);
+        };
+    };
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    uint64_t now, sequence;
+    bool frame_complete;
+    //When the scanline the ppu is on started.
+    uint64_t scanline_start;
+    /* A mapper scanline counter is caught up to the clock whenever something that affects it is written, and its next
+     * IRQ is scheduled as one event at the dot the counter will reach zero. */
+    Mapper *scanline_counter;
+    uint64_t scanline_counter_synced_at, mapper_irq_time;
+    uint32_t mapper_irq_generation;
+    Cpu *cpu;
+    Ppu *ppu;
+    Rom *rom;
+    InterruptLines *interrupts;
+    void dispatch(const Event&);
+    int64_t get_frame_start();
+    int64_t count_scanline_clocks(uint64_t, int);
+    uint64_t get_scanline_clock_time(int64_t, int);
+    void sync_mapper_irq(uint64_t);
+public:
+    Scheduler();
+    void connect_cpu(Cpu*);
+    void connect_ppu(Ppu*);
+    void connect_rom(Rom*);
+    void connect_interrupts(InterruptLines*);
+    void reset();
+    void schedule(EventType, uint64_t, uint32_t generation = 0);
+    void sync_mapper_irq();
+    void schedule_mapper_irq();
+    uint64_t get_time() {return this->now;};
+    void run_frame();
+};
+
+#endif //SCHEDULER_HXX
@@ -0,0 +1,24 @@
+#include "system.hxx"
+
+//The rom has to be loaded before it's connected, the bus maps its PRG-ROM pages straight away.
+System::System(const char *rom_path) {
+    this->rom.load_from_file(rom_path);
+    this->cpu.connect_bus(&this->bus);
+    this->bus.connect_ppu(&this->ppu);
+    this->bus.connect_rom(&this->rom);
+    this->bus.connect_controller(&this->controller);
+    this->bus.connect_scheduler(&this->scheduler);
+    this->ppu.connect_bus(&this->bus);
+    this->ppu.connect_frame(&this->frame);
+    this->scheduler.connect_cpu(&this->cpu);
+    this->scheduler.connect_ppu(&this->ppu);
+    this->scheduler.connect_rom(&this->rom);
+    this->scheduler.connect_interrupts(&this->bus.interrupts);
+}
+
+void System::reset() {
+    this->cpu.reset();
+    this->ppu.reset();
+    this->scheduler.reset();
+    this->frame.clear();
+}
@@ -0,0 +1,37 @@
+#ifndef SYSTEM_HXX
+#define SYSTEM_HXX
+#include "cpu.hxx"
+#include "bus.hxx"
+#include "ppu.hxx"
+#include "rom.hxx"
+#include "frame.hxx"
+#include "controller.hxx"
+#include "scheduler.hxx"
+
+/* The whole console as one object. Every component lives inside it by value, so they share one allocation and the
+ * addresses the connect_* calls hand out are fixed for as long as the System exists, which is also why it can't be
+ * copied or moved. The build turns on link time optimisation, so the calls across those pointers can still be inlined
+ * into the cpu even though the components are compiled separately. */
+
+class System {
+public:
+    //Ordered by how often the cpu reaches into them, the cartridge and everything after it is cold.
+    Cpu cpu;
+    Bus bus;
+    Ppu ppu;
+    Rom rom;
+    Frame frame;
+    Controller controller;
+    Scheduler scheduler;
+    explicit System(const char*);
+    System(const System&) = delete;
+    System &operator=(const System&) = delete;
+    void reset();
+    //Battery backed saves are written back once a frame.
+    void run_frame() {
+        this->scheduler.run_frame();
+        this->rom.sync_prgram();
+    };
+};
+
+#endif //SYSTEM_HXX